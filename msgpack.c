@@ -1,10 +1,29 @@
+// For posix_madvise & truncate, which -std=c99 hides otherwise
+#define _POSIX_C_SOURCE 200809L
+// ...without hiding the rest of what macOS declares, such as _SC_NPROCESSORS_ONLN
+#define _DARWIN_C_SOURCE
+
 #include <stdlib.h>
 #include <stdbool.h>
 #include <assert.h>
 #include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <locale.h>
 
 #include <janet.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 #include "mpack.h"
 
 static uint64_t ensure_bigendian(uint64_t val) {
@@ -29,6 +48,14 @@ static uint64_t ensure_bigendian(uint64_t val) {
     }
 }
 
+static inline uint64_t read_bigendian(const uint8_t *data, uint8_t bytes) {
+    uint64_t result = 0;
+    for (uint8_t i = 0; i < bytes; i++) {
+        result = (result << 8) | data[i];
+    }
+    return result;
+}
+
 enum msgpack_string_type {
     MSGPACK_STRING_STRING = 0,
     MSGPACK_BYTES_STRING = 1
@@ -67,6 +94,8 @@ static const struct enum_entry JANET_TYPE_ENUM[] = {
     {"keyword", JANET_KEYWORD},
     {"struct", JANET_STRUCT},
     {"table", JANET_TABLE},
+    {"tuple", JANET_TUPLE},
+    {"array", JANET_ARRAY},
     {NULL, 0}
 };
 /**
@@ -102,13 +131,376 @@ static int parse_named_enum(Janet value, const char *enum_name, const struct enu
     );
 }
 
+/**************/
+/* Timestamps */
+/**************/
+
+/*
+ * The standard msgpack timestamp extension (type -1).
+ */
+#define MSGPACK_EXT_TIMESTAMP (-1)
+
+enum msgpack_timestamp_type {
+    MSGPACK_TIMESTAMP_NUMBER = 0,
+    MSGPACK_TIMESTAMP_ABSTRACT = 1
+};
+static const struct enum_entry MSGPACK_TIMESTAMP_TYPE_ENUM[] = {
+    {"number", MSGPACK_TIMESTAMP_NUMBER},
+    {"abstract", MSGPACK_TIMESTAMP_ABSTRACT},
+    {"timestamp", MSGPACK_TIMESTAMP_ABSTRACT},
+    {NULL, 0}
+};
+
+struct msgpack_timestamp {
+    int64_t seconds;
+    uint32_t nanoseconds;
+};
+
+static int timestamp_get(void *p, Janet key, Janet *out) {
+    struct msgpack_timestamp *timestamp = p;
+    if (!janet_checktype(key, JANET_KEYWORD)) return 0;
+    const char *name = (const char*) janet_unwrap_keyword(key);
+    if (strcmp(name, "seconds") == 0) {
+        if (timestamp->seconds >= -(INT64_C(1) << 53) && timestamp->seconds <= (INT64_C(1) << 53)) {
+            *out = janet_wrap_number((double) timestamp->seconds);
+        } else {
+            #ifdef JANET_INT_TYPES
+                *out = janet_wrap_s64(timestamp->seconds);
+            #else
+                *out = janet_wrap_number((double) timestamp->seconds);
+            #endif
+        }
+        return 1;
+    } else if (strcmp(name, "nanoseconds") == 0) {
+        *out = janet_wrap_number((double) timestamp->nanoseconds);
+        return 1;
+    }
+    return 0;
+}
+static void timestamp_tostring(void *p, JanetBuffer *buffer) {
+    struct msgpack_timestamp *timestamp = p;
+    char text[48];
+    snprintf(text, sizeof(text), "%lld.%09u", (long long) timestamp->seconds, (unsigned) timestamp->nanoseconds);
+    janet_buffer_push_cstring(buffer, text);
+}
+static int timestamp_compare(void *lhs, void *rhs) {
+    struct msgpack_timestamp *a = lhs, *b = rhs;
+    if (a->seconds != b->seconds) return a->seconds < b->seconds ? -1 : 1;
+    if (a->nanoseconds != b->nanoseconds) return a->nanoseconds < b->nanoseconds ? -1 : 1;
+    return 0;
+}
+static int32_t timestamp_hash(void *p, size_t len) {
+    (void) len;
+    struct msgpack_timestamp *timestamp = p;
+    uint64_t bits = (uint64_t) timestamp->seconds * UINT64_C(0x9E3779B97F4A7C15) ^ timestamp->nanoseconds;
+    return (int32_t) (bits ^ (bits >> 32));
+}
+static const JanetAbstractType msgpack_timestamp_type = {
+    "msgpack/timestamp",
+    NULL,
+    NULL,
+    timestamp_get,
+    NULL,
+    NULL,
+    NULL,
+    timestamp_tostring,
+    timestamp_compare,
+    timestamp_hash,
+    JANET_ATEND_HASH
+};
+
+static Janet wrap_timestamp(int64_t seconds, uint32_t nanoseconds) {
+    struct msgpack_timestamp *timestamp = janet_abstract(&msgpack_timestamp_type, sizeof(struct msgpack_timestamp));
+    timestamp->seconds = seconds;
+    timestamp->nanoseconds = nanoseconds;
+    return janet_wrap_abstract(timestamp);
+}
+
+/**
+ * Parse the payload of a timestamp in any of the 32/64/96-bit forms.
+ *
+ * Returns false if the payload is malformed.
+ */
+static bool read_msgpack_timestamp(const uint8_t *data, uint32_t len, struct msgpack_timestamp *timestamp) {
+    switch (len) {
+        case 4:
+            timestamp->seconds = (int64_t) read_bigendian(data, 4);
+            timestamp->nanoseconds = 0;
+            break;
+        case 8: {
+            uint64_t value = read_bigendian(data, 8);
+            timestamp->nanoseconds = (uint32_t) (value >> 34);
+            timestamp->seconds = (int64_t) (value & ((UINT64_C(1) << 34) - 1));
+            break;
+        }
+        case 12:
+            timestamp->nanoseconds = (uint32_t) read_bigendian(data, 4);
+            timestamp->seconds = (int64_t) read_bigendian(data + 4, 8);
+            break;
+        default:
+            return false;
+    }
+    return timestamp->nanoseconds < 1000000000;
+}
+
+static Janet janet_msgpack_timestamp(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 2);
+    int64_t seconds;
+    uint32_t nanoseconds = 0;
+    if (argc > 1) {
+        seconds = janet_getinteger64(argv, 0);
+        int64_t nanos = janet_getinteger64(argv, 1);
+        if (nanos < 0 || nanos >= 1000000000) janet_panicf("Nanoseconds %v out of range [0, 1e9)", argv[1]);
+        nanoseconds = (uint32_t) nanos;
+    } else {
+        double value = janet_getnumber(argv, 0);
+        double whole = floor(value);
+        if (!(whole >= -9.2e18 && whole <= 9.2e18)) janet_panicf("Timestamp %v out of range", argv[0]);
+        seconds = (int64_t) whole;
+        double nanos = floor((value - whole) * 1e9 + 0.5);
+        if (nanos >= 1e9) {
+            seconds += 1;
+            nanos = 0;
+        }
+        nanoseconds = (uint32_t) nanos;
+    }
+    return wrap_timestamp(seconds, nanoseconds);
+}
+
+/**************/
+/* Extensions */
+/**************/
+
+/*
+ * Default ext types for this library's own optional layouts. Both ends have
+ * to opt in, and can pick another type if these clash with an application's.
+ */
+#define MSGPACK_EXT_COLUMNS 100
+#define MSGPACK_EXT_DICTIONARY 101
+#define MSGPACK_EXT_BACKREF 102
+#define MSGPACK_EXT_SHARED 103
+
+/*
+ * A registry of handlers for application-defined ext types.
+ *
+ * Decoders are indexed directly by ext type. A decoder that is a C function
+ * is called through its function pointer, skipping the Janet VM entirely.
+ * Encoders are keyed by abstract type, and return the payload bytes.
+ */
+struct msgpack_ext_registry {
+    Janet decoders[256];
+    JanetCFunction native_decoders[256];
+    // Maps abstract type pointers -> (ext-type encoder)
+    JanetTable *encoders;
+};
+
+static int ext_registry_gcmark(void *p, size_t len) {
+    (void) len;
+    struct msgpack_ext_registry *registry = p;
+    for (int i = 0; i < 256; i++) janet_mark(registry->decoders[i]);
+    janet_mark(janet_wrap_table(registry->encoders));
+    return 0;
+}
+static const JanetAbstractType msgpack_ext_registry_type = {
+    "msgpack/ext-registry",
+    NULL,
+    ext_registry_gcmark,
+    JANET_ATEND_GCMARK
+};
+
+/**
+ * Call an ext handler with a single argument.
+ *
+ * The garbage collector is held off while a Janet function runs, since
+ * partially decoded values only live on the C stack.
+ */
+static Janet call_ext_handler(Janet handler, JanetCFunction native, Janet arg) {
+    if (native != NULL) return native(1, &arg);
+    int handle = janet_gclock();
+    Janet out;
+    JanetSignal signal = janet_pcall(janet_unwrap_function(handler), 1, &arg, &out, NULL);
+    janet_gcunlock(handle);
+    if (signal != JANET_SIGNAL_OK) janet_panicv(out);
+    return out;
+}
+
+static Janet janet_msgpack_ext_registry(int32_t argc, Janet *argv) {
+    (void) argv;
+    janet_fixarity(argc, 0);
+    struct msgpack_ext_registry *registry = janet_abstract(&msgpack_ext_registry_type, sizeof(struct msgpack_ext_registry));
+    for (int i = 0; i < 256; i++) {
+        registry->decoders[i] = janet_wrap_nil();
+        registry->native_decoders[i] = NULL;
+    }
+    registry->encoders = janet_table(0);
+    return janet_wrap_abstract(registry);
+}
+
+static Janet janet_msgpack_register_ext(int32_t argc, Janet *argv) {
+    janet_arity(argc, 3, 5);
+    struct msgpack_ext_registry *registry = janet_getabstract(argv, 0, &msgpack_ext_registry_type);
+    int32_t code = janet_getinteger(argv, 1);
+    if (code < -128 || code > 127) janet_panicf("Ext type %d out of range [-128, 127]", code);
+    uint8_t index = (uint8_t) (int8_t) code;
+    switch (janet_type(argv[2])) {
+        case JANET_NIL:
+            registry->native_decoders[index] = NULL;
+            break;
+        case JANET_CFUNCTION:
+            registry->native_decoders[index] = janet_unwrap_cfunction(argv[2]);
+            break;
+        case JANET_FUNCTION:
+            registry->native_decoders[index] = NULL;
+            break;
+        default:
+            janet_panicf("Expected a function to decode ext type %d, but got %t", code, argv[2]);
+    }
+    registry->decoders[index] = argv[2];
+    if (argc > 3) {
+        const JanetAbstractType *at = janet_get_abstract_type(janet_csymbolv(janet_getcstring(argv, 3)));
+        if (at == NULL) janet_panicf("Unknown abstract type %v", argv[3]);
+        if (argc < 5 || !(janet_checktype(argv[4], JANET_FUNCTION) || janet_checktype(argv[4], JANET_CFUNCTION))) {
+            janet_panicf("Expected a function to encode %v", argv[3]);
+        }
+        Janet entry[2] = {janet_wrap_integer(code), argv[4]};
+        janet_table_put(registry->encoders, janet_wrap_pointer((void*) at), janet_wrap_tuple(janet_tuple_n(entry, 2)));
+    }
+    return argv[0];
+}
+
+/**************/
+/* Raw Values */
+/**************/
+
+/*
+ * Already-encoded msgpack, which encode splices into its output verbatim.
+ */
+struct msgpack_raw {
+    // An immutable string holding exactly one encoded object
+    Janet bytes;
+};
+
+static int raw_gcmark(void *p, size_t len) {
+    (void) len;
+    janet_mark(((struct msgpack_raw*) p)->bytes);
+    return 0;
+}
+static int raw_get(void *p, Janet key, Janet *out) {
+    struct msgpack_raw *raw = p;
+    if (janet_keyeq(key, "bytes")) {
+        *out = raw->bytes;
+        return 1;
+    }
+    return 0;
+}
+static const JanetAbstractType msgpack_raw_type = {
+    "msgpack/raw",
+    NULL,
+    raw_gcmark,
+    raw_get,
+    JANET_ATEND_GET
+};
+
+static Janet wrap_raw(const uint8_t *data, size_t len) {
+    struct msgpack_raw *raw = janet_abstract(&msgpack_raw_type, sizeof(struct msgpack_raw));
+    raw->bytes = janet_wrap_string(janet_string(data, (int32_t) len));
+    return janet_wrap_abstract(raw);
+}
+
+/****************/
+/* Dictionaries */
+/****************/
+
+/*
+ * A dictionary of common strings shared by both ends of a connection.
+ *
+ * Strings in the dictionary are encoded as a fixext holding their index,
+ * which decodes straight back to a pre-built keyword or string.
+ */
+#define MSGPACK_DICTIONARY_MAX 0x10000
+
+struct msgpack_dictionary {
+    // Tuples of the entries as strings & keywords, by index
+    const Janet *strings;
+    const Janet *keywords;
+    // Maps the string, keyword & symbol of each entry -> index
+    JanetTable *index;
+    int8_t exttype;
+};
+
+static int dictionary_gcmark(void *p, size_t len) {
+    (void) len;
+    struct msgpack_dictionary *dictionary = p;
+    janet_mark(janet_wrap_tuple(dictionary->strings));
+    janet_mark(janet_wrap_tuple(dictionary->keywords));
+    janet_mark(janet_wrap_table(dictionary->index));
+    return 0;
+}
+static int dictionary_get(void *p, Janet key, Janet *out) {
+    struct msgpack_dictionary *dictionary = p;
+    if (janet_keyeq(key, "entries")) {
+        *out = janet_wrap_tuple(dictionary->strings);
+        return 1;
+    } else if (janet_keyeq(key, "ext-type")) {
+        *out = janet_wrap_integer(dictionary->exttype);
+        return 1;
+    }
+    return 0;
+}
+static const JanetAbstractType msgpack_dictionary_type = {
+    "msgpack/dictionary",
+    NULL,
+    dictionary_gcmark,
+    dictionary_get,
+    JANET_ATEND_GET
+};
+
+/**
+ * Look up a string, keyword or symbol, returning its index or -1.
+ */
+static int32_t dictionary_lookup(const struct msgpack_dictionary *dictionary, Janet value) {
+    Janet index = janet_table_get(dictionary->index, value);
+    return janet_checktype(index, JANET_NIL) ? -1 : janet_unwrap_integer(index);
+}
+
 struct msgpack_encoder {
     JanetBuffer *buffer;
     enum msgpack_string_type string_type;
     enum msgpack_string_type buffer_type;
+    // Optional, used to encode abstract types
+    struct msgpack_ext_registry *registry;
+    // Optional, strings in it are encoded as references
+    struct msgpack_dictionary *dictionary;
+    // Optional, maps strings already written -> their offset from message_start
+    JanetTable *dedupe;
+    int8_t dedupe_ext;
+    // Optional, maps containers already written -> their offset from message_start
+    JanetTable *shared;
+    int8_t shared_ext;
+    // Where the message begins in the buffer, which references are relative to
+    int32_t message_start;
+    // Set on encode-parallel's worker threads, which can't run Janet code
+    bool on_worker;
+    // Encode arrays of uniform records column by column, as this ext type
+    bool columnar;
+    int8_t columnar_ext;
+    // Sort map keys & use the shortest encoding of numbers, so equal values encode identically
+    bool canonical;
 };
 
 static void encode_msgpack_int(struct msgpack_encoder *encoder, int64_t value, bool actually_unsigned);
+static void encode_msgpack_timestamp(struct msgpack_encoder *encoder, const struct msgpack_timestamp *timestamp);
+static void encode_msgpack_ext(struct msgpack_encoder *encoder, int8_t exttype, const uint8_t *data, uint32_t len);
+static void encode_msgpack_fiber(struct msgpack_encoder *encoder, JanetFiber *fiber, int depth);
+static bool encode_dictionary_ref(struct msgpack_encoder *encoder, Janet value, int32_t len);
+static bool encode_backref(struct msgpack_encoder *encoder, Janet value, int32_t len);
+static bool encode_shared_ref(struct msgpack_encoder *encoder, Janet value);
+static bool is_uniform_records(const Janet *items, int32_t len);
+static void encode_msgpack_double(struct msgpack_encoder *encoder, double value);
+static int32_t *sort_map_keys(struct msgpack_encoder *encoder, const JanetKV *kvs, int32_t count, int32_t capacity);
+static void encode_msgpack_columns(struct msgpack_encoder *encoder, const Janet *items, int32_t len, int depth);
+static void encode_canonical_raw(struct msgpack_encoder *encoder, const uint8_t *data, size_t len, size_t *pos, int depth);
+static void sort_encoded_map_entries(JanetBuffer *buffer, int32_t start, uint32_t count);
 static inline void encode_int_without_tag(JanetBuffer *buffer, uint64_t target, uint8_t needed_bytes);
 static inline void encode_int_tagged(JanetBuffer *buffer, uint64_t target, uint8_t needed_bytes, uint8_t tag_start) {
     uint8_t tag;
@@ -146,6 +538,51 @@ static void encode_msgpack_collection_length(struct msgpack_encoder *encoder, in
         encode_int_without_tag(buffer, (uint32_t) len, 4);
     }
 }
+/**
+ * Reserve the widest header for an array/map whose length isn't known yet.
+ *
+ * Returns the offset of the header, to pass to finish_msgpack_collection.
+ */
+static int32_t reserve_msgpack_collection(struct msgpack_encoder *encoder) {
+    static const uint8_t placeholder[5] = {0};
+    int32_t offset = encoder->buffer->count;
+    janet_buffer_push_bytes(encoder->buffer, placeholder, 5);
+    return offset;
+}
+/**
+ * Patch a reserved header with the final length.
+ *
+ * If a narrower header would do, the contents are shifted down over the
+ * unused bytes, so the output is the same as if the length was known up front.
+ */
+static void finish_msgpack_collection(struct msgpack_encoder *encoder, int32_t offset, uint32_t len, bool is_map) {
+    JanetBuffer *buffer = encoder->buffer;
+    uint8_t header[5];
+    int32_t header_len;
+    // Compacting would move values that references point at
+    bool compact = encoder->dedupe == NULL && encoder->shared == NULL;
+    if (compact && len <= 15) {
+        header[0] = (is_map ? 0x80 : 0x90) | (uint8_t) len;
+        header_len = 1;
+    } else if (compact && len <= 0xFFFF) {
+        header[0] = is_map ? 0xDE : 0xDC;
+        header[1] = (uint8_t) (len >> 8);
+        header[2] = (uint8_t) len;
+        header_len = 3;
+    } else {
+        header[0] = is_map ? 0xDF : 0xDD;
+        header[1] = (uint8_t) (len >> 24);
+        header[2] = (uint8_t) (len >> 16);
+        header[3] = (uint8_t) (len >> 8);
+        header[4] = (uint8_t) len;
+        header_len = 5;
+    }
+    memcpy(buffer->data + offset, header, header_len);
+    if (header_len < 5) {
+        memmove(buffer->data + offset + header_len, buffer->data + offset + 5, buffer->count - offset - 5);
+        buffer->count -= 5 - header_len;
+    }
+}
 static void encode_msgpack(struct msgpack_encoder *encoder, Janet value, int depth) {
     if (depth > JANET_RECURSION_GUARD) janet_panic("recursed too deeply");
     switch (janet_type(value)) {
@@ -163,6 +600,8 @@ static void encode_msgpack(struct msgpack_encoder *encoder, Janet value, int dep
         case JANET_NUMBER:
             if (janet_checkint(value)) {
                 encode_msgpack_int(encoder, janet_unwrap_integer(value), false);
+            } else if (encoder->canonical) {
+                encode_msgpack_double(encoder, janet_unwrap_number(value));
             } else {
                 union bytesvalue {
                     double d;
@@ -179,6 +618,8 @@ static void encode_msgpack(struct msgpack_encoder *encoder, Janet value, int dep
             const uint8_t *data;
             int32_t len;
             janet_bytes_view(value, &data, &len);
+            if (encoder->dictionary != NULL && encode_dictionary_ref(encoder, value, len)) break;
+            if (encoder->dedupe != NULL && encode_backref(encoder, value, len)) break;
             // keyword & symbol are unconditionally strings
             encode_msgpack_string(encoder, data, len, MSGPACK_STRING_STRING);
             break;
@@ -190,10 +631,51 @@ static void encode_msgpack(struct msgpack_encoder *encoder, Janet value, int dep
             const uint8_t *data;
             int32_t len;
             janet_bytes_view(value, &data, &len);
+            if (string_type == MSGPACK_STRING_STRING && janet_checktype(value, JANET_STRING)) {
+                if (encoder->dictionary != NULL && encode_dictionary_ref(encoder, value, len)) break;
+                if (encoder->dedupe != NULL && encode_backref(encoder, value, len)) break;
+            }
             encode_msgpack_string(encoder, data, len, string_type);
             break;
         }
-        case JANET_ABSTRACT:
+        case JANET_ABSTRACT: {
+            const struct msgpack_raw *raw = janet_checkabstract(value, &msgpack_raw_type);
+            if (raw != NULL) {
+                const uint8_t *bytes = janet_unwrap_string(raw->bytes);
+                if (encoder->canonical) {
+                    // Raw bytes may come from anywhere, so re-encode them the canonical way
+                    size_t len = (size_t) janet_string_length(bytes), pos = 0;
+                    while (pos < len) encode_canonical_raw(encoder, bytes, len, &pos, depth);
+                } else {
+                    janet_buffer_push_string(encoder->buffer, bytes);
+                }
+                return;
+            }
+            if (encoder->registry != NULL) {
+                const JanetAbstractType *at = janet_abstract_type(janet_unwrap_abstract(value));
+                Janet entry = janet_table_get(encoder->registry->encoders, janet_wrap_pointer((void*) at));
+                if (!janet_checktype(entry, JANET_NIL)) {
+                    const Janet *handler = janet_unwrap_tuple(entry);
+                    JanetCFunction native = janet_checktype(handler[1], JANET_CFUNCTION) ? janet_unwrap_cfunction(handler[1]) : NULL;
+                    if (native == NULL && encoder->on_worker) {
+                        janet_panicf("Cannot call the %s ext encoder from an encoding worker thread", at->name);
+                    }
+                    Janet payload = call_ext_handler(handler[1], native, value);
+                    const uint8_t *data;
+                    int32_t len;
+                    if (!janet_bytes_view(payload, &data, &len)) {
+                        janet_panicf("Expected the %s ext encoder to return bytes, but got %t", at->name, payload);
+                    }
+                    encode_msgpack_ext(encoder, (int8_t) janet_unwrap_integer(handler[0]), data, (uint32_t) len);
+                    return;
+                }
+            }
+            // Built in, but registered handlers take priority
+            const struct msgpack_timestamp *timestamp = janet_checkabstract(value, &msgpack_timestamp_type);
+            if (timestamp != NULL) {
+                encode_msgpack_timestamp(encoder, timestamp);
+                return;
+            }
             #ifdef JANET_INT_TYPES
             switch (janet_is_int(value)) {
                 case JANET_INT_S64:
@@ -207,11 +689,17 @@ static void encode_msgpack(struct msgpack_encoder *encoder, Janet value, int dep
             }
             #endif // JANET_INT_TYPES
             goto unknown_type;
+        }
         case JANET_TUPLE:
         case JANET_ARRAY: {
             const Janet *items;
             int32_t len;
             janet_indexed_view(value, &items, &len);
+            if (encoder->shared != NULL && encode_shared_ref(encoder, value)) break;
+            if (encoder->columnar && is_uniform_records(items, len)) {
+                encode_msgpack_columns(encoder, items, len, depth);
+                break;
+            }
             encode_msgpack_collection_length(
                 encoder,
                 len,
@@ -228,12 +716,22 @@ static void encode_msgpack(struct msgpack_encoder *encoder, Janet value, int dep
             const JanetKV *kvs;
             int32_t count, capacity;
             janet_dictionary_view(value, &kvs, &count, &capacity);
+            if (encoder->shared != NULL && encode_shared_ref(encoder, value)) break;
             encode_msgpack_collection_length(
                 encoder,
                 count,
                 0x80,
                 0xDE
             );
+            if (encoder->canonical) {
+                int32_t *order = sort_map_keys(encoder, kvs, count, capacity);
+                for (int32_t i = 0; i < count; i++) {
+                    encode_msgpack(encoder, kvs[order[i]].key, depth + 1);
+                    encode_msgpack(encoder, kvs[order[i]].value, depth + 1);
+                }
+                janet_sfree(order);
+                break;
+            }
             for (int32_t i = 0; i < capacity; i++) {
                 if (janet_checktype(kvs[i].key, JANET_NIL))  continue;
                 encode_msgpack(encoder, kvs[i].key, depth + 1);
@@ -241,12 +739,318 @@ static void encode_msgpack(struct msgpack_encoder *encoder, Janet value, int dep
             }
             break;
         }
+        case JANET_FIBER:
+            if (encoder->on_worker) janet_panic("Cannot resume a fiber from an encoding worker thread");
+            encode_msgpack_fiber(encoder, janet_unwrap_fiber(value), depth);
+            break;
         default:
             goto unknown_type;
     }
+    return;
 unknown_type:
     janet_panicf("Unknown type: %t", value);
 }
+
+/**
+ * Encode the values yielded by a fiber (such as a generator) as an array.
+ *
+ * Each item is encoded as soon as it's yielded, so the sequence never has to
+ * exist in memory all at once.
+ */
+static void encode_msgpack_fiber(struct msgpack_encoder *encoder, JanetFiber *fiber, int depth) {
+    int32_t header = reserve_msgpack_collection(encoder);
+    uint32_t count = 0;
+    // A finished fiber is an empty sequence, just like with `each`
+    if (janet_fiber_status(fiber) == JANET_STATUS_DEAD) {
+        finish_msgpack_collection(encoder, header, 0, false);
+        return;
+    }
+    /*
+     * Resuming the fiber may collect garbage, and neither our buffer nor the
+     * item being encoded are necessarily reachable from anywhere else.
+     */
+    JanetArray *roots = janet_array(4);
+    janet_array_push(roots, janet_wrap_buffer(encoder->buffer));
+    if (encoder->dedupe != NULL) janet_array_push(roots, janet_wrap_table(encoder->dedupe));
+    if (encoder->shared != NULL) janet_array_push(roots, janet_wrap_table(encoder->shared));
+    int32_t base_roots = roots->count;
+    janet_gcroot(janet_wrap_array(roots));
+    JanetTryState state;
+    if (janet_try(&state)) {
+        janet_restore(&state);
+        janet_gcunroot(janet_wrap_array(roots));
+        janet_panicv(state.payload);
+    }
+    while (true) {
+        Janet item;
+        JanetSignal signal = janet_continue(fiber, janet_wrap_nil(), &item);
+        if (signal == JANET_SIGNAL_OK) break;
+        if (signal == JANET_SIGNAL_ERROR) janet_panicv(item);
+        if (signal != JANET_SIGNAL_YIELD) janet_panicf("Unexpected signal %d from fiber being encoded", (int32_t) signal);
+        if (count == UINT32_MAX) janet_panic("Too many items for a msgpack array");
+        janet_array_push(roots, item);
+        encode_msgpack(encoder, item, depth + 1);
+        roots->count = base_roots;
+        count++;
+    }
+    janet_restore(&state);
+    janet_gcunroot(janet_wrap_array(roots));
+    finish_msgpack_collection(encoder, header, count, false);
+}
+/**
+ * Encode a reference to a dictionary entry, if it's shorter than the string itself.
+ */
+static bool encode_dictionary_ref(struct msgpack_encoder *encoder, Janet value, int32_t len) {
+    // Strings shorter than the smallest reference (a fixext1) aren't even looked up
+    if (len < 3) return false;
+    int32_t index = dictionary_lookup(encoder->dictionary, value);
+    if (index < 0) return false;
+    uint8_t payload[2] = {(uint8_t) (index >> 8), (uint8_t) (index & 0xFF)};
+    if (index <= 0xFF) {
+        encode_msgpack_ext(encoder, encoder->dictionary->exttype, payload + 1, 1);
+    } else {
+        if (len < 4) return false;
+        encode_msgpack_ext(encoder, encoder->dictionary->exttype, payload, 2);
+    }
+    return true;
+}
+/**
+ * Encode an ext holding an offset into the message, in as few bytes as possible.
+ */
+static void encode_offset_ref(struct msgpack_encoder *encoder, int8_t exttype, uint32_t offset) {
+    uint32_t ref_len = offset <= 0xFF ? 1 : offset <= 0xFFFF ? 2 : 4;
+    uint8_t payload[4] = {
+        (uint8_t) (offset >> 24),
+        (uint8_t) ((offset >> 16) & 0xFF),
+        (uint8_t) ((offset >> 8) & 0xFF),
+        (uint8_t) (offset & 0xFF)
+    };
+    encode_msgpack_ext(encoder, exttype, payload + 4 - ref_len, ref_len);
+}
+/**
+ * Encode a repeated string as a reference to the offset of its first occurrence,
+ * if that's shorter. Otherwise remember where it's about to be written.
+ */
+static bool encode_backref(struct msgpack_encoder *encoder, Janet value, int32_t len) {
+    // Strings shorter than the smallest reference (a fixext1) aren't tracked
+    if (len < 3) return false;
+    Janet seen = janet_table_get(encoder->dedupe, value);
+    if (janet_checktype(seen, JANET_NIL)) {
+        int32_t here = encoder->buffer->count - encoder->message_start;
+        janet_table_put(encoder->dedupe, value, janet_wrap_integer(here));
+        return false;
+    }
+    uint32_t offset = (uint32_t) janet_unwrap_integer(seen);
+    uint32_t literal_len = (uint32_t) len + (len < 32 ? 1 : len <= 0xFF ? 2 : len <= 0xFFFF ? 3 : 5);
+    uint32_t ref_len = offset <= 0xFF ? 1 : offset <= 0xFFFF ? 2 : 4;
+    if (ref_len + 2 >= literal_len) return false;
+    encode_offset_ref(encoder, encoder->dedupe_ext, offset);
+    return true;
+}
+/**
+ * Encode a container that was already written as a reference to its offset.
+ * Otherwise remember where it's about to be written, before its contents,
+ * so that cycles back to it become references too.
+ *
+ * Tables and arrays are tracked by identity, tuples and structs by value.
+ */
+static bool encode_shared_ref(struct msgpack_encoder *encoder, Janet value) {
+    // Empty tuples & structs are shorter than any reference
+    if (janet_checktypes(value, JANET_TFLAG_TUPLE | JANET_TFLAG_STRUCT) && janet_length(value) == 0) return false;
+    Janet seen = janet_table_get(encoder->shared, value);
+    if (janet_checktype(seen, JANET_NIL)) {
+        int32_t here = encoder->buffer->count - encoder->message_start;
+        janet_table_put(encoder->shared, value, janet_wrap_integer(here));
+        return false;
+    }
+    encode_offset_ref(encoder, encoder->shared_ext, (uint32_t) janet_unwrap_integer(seen));
+    return true;
+}
+/**
+ * Encode a non-integer Janet number in the fewest bytes that round-trip it.
+ *
+ * Integral values become msgpack ints, and values that a float holds
+ * exactly become floats. All NaNs are written as the same float NaN.
+ */
+static void encode_msgpack_double(struct msgpack_encoder *encoder, double value) {
+    JanetBuffer *buffer = encoder->buffer;
+    if (value != value) {
+        janet_buffer_push_u8(buffer, 0xCA);
+        encode_int_without_tag(buffer, 0x7FC00000, 4);
+        return;
+    }
+    if (value == floor(value)) {
+        if (value >= -9223372036854775808.0 && value < 9223372036854775808.0) {
+            encode_msgpack_int(encoder, (int64_t) value, false);
+            return;
+        }
+        if (value >= 0 && value < 18446744073709551616.0) {
+            encode_msgpack_int(encoder, (int64_t) (uint64_t) value, /* actually unsigned */ true);
+            return;
+        }
+    }
+    union {
+        float f;
+        uint32_t i;
+    } narrow;
+    narrow.f = (float) value;
+    if ((double) narrow.f == value) {
+        janet_buffer_push_u8(buffer, 0xCA);
+        encode_int_without_tag(buffer, narrow.i, 4);
+        return;
+    }
+    union {
+        double d;
+        uint64_t i;
+    } wide;
+    wide.d = value;
+    janet_buffer_push_u8(buffer, 0xCB);
+    encode_int_without_tag(buffer, wide.i, 8);
+}
+struct msgpack_sort_key {
+    const uint8_t *bytes;
+    int32_t len;
+    int32_t slot;
+};
+static int compare_sort_keys(const void *a, const void *b) {
+    const struct msgpack_sort_key *x = a, *y = b;
+    int32_t len = x->len < y->len ? x->len : y->len;
+    int result = memcmp(x->bytes, y->bytes, (size_t) len);
+    if (result != 0) return result;
+    return (x->len > y->len) - (x->len < y->len);
+}
+static int compare_string_sort_keys(const void *a, const void *b) {
+    const struct msgpack_sort_key *x = a, *y = b;
+    if (x->len != y->len) return x->len < y->len ? -1 : 1;
+    return memcmp(x->bytes, y->bytes, (size_t) x->len);
+}
+/**
+ * Order the slots of a map's entries by the bytes of their encoded keys.
+ *
+ * Returns the slot indices (to be freed with janet_sfree) in canonical order.
+ * Keys are encoded plainly for sorting, without dictionary or back-references.
+ */
+static int32_t *sort_map_keys(struct msgpack_encoder *encoder, const JanetKV *kvs, int32_t count, int32_t capacity) {
+    struct msgpack_sort_key *keys = janet_smalloc(sizeof(struct msgpack_sort_key) * (size_t) (count ? count : 1));
+    bool all_strings = true;
+    for (int32_t i = 0, k = 0; i < capacity; i++) {
+        if (janet_checktype(kvs[i].key, JANET_NIL)) continue;
+        keys[k++].slot = i;
+        Janet key = kvs[i].key;
+        all_strings = all_strings && (janet_checktypes(key, JANET_TFLAG_KEYWORD | JANET_TFLAG_SYMBOL)
+            || (janet_checktype(key, JANET_STRING) && encoder->string_type == MSGPACK_STRING_STRING));
+    }
+    if (all_strings) {
+        /*
+         * A msgpack string's header only grows with its length, so ordering
+         * by (length, bytes) is the same as ordering by the encoded form.
+         */
+        for (int32_t k = 0; k < count; k++) {
+            janet_bytes_view(kvs[keys[k].slot].key, &keys[k].bytes, &keys[k].len);
+        }
+        qsort(keys, (size_t) count, sizeof(struct msgpack_sort_key), compare_string_sort_keys);
+    } else {
+        struct msgpack_encoder key_encoder = *encoder;
+        key_encoder.buffer = janet_buffer(count * 8);
+        key_encoder.dictionary = NULL;
+        key_encoder.dedupe = NULL;
+        key_encoder.shared = NULL;
+        key_encoder.columnar = false;
+        int32_t *offsets = janet_smalloc(sizeof(int32_t) * (size_t) (count + 1));
+        for (int32_t k = 0; k < count; k++) {
+            offsets[k] = key_encoder.buffer->count;
+            encode_msgpack(&key_encoder, kvs[keys[k].slot].key, 0);
+        }
+        offsets[count] = key_encoder.buffer->count;
+        // The buffer is done growing, so it's now safe to point into it
+        for (int32_t k = 0; k < count; k++) {
+            keys[k].bytes = key_encoder.buffer->data + offsets[k];
+            keys[k].len = offsets[k + 1] - offsets[k];
+        }
+        janet_sfree(offsets);
+        qsort(keys, (size_t) count, sizeof(struct msgpack_sort_key), compare_sort_keys);
+    }
+    int32_t *order = janet_smalloc(sizeof(int32_t) * (size_t) (count ? count : 1));
+    for (int32_t k = 0; k < count; k++) order[k] = keys[k].slot;
+    janet_sfree(keys);
+    return order;
+}
+/**
+ * Look up a key of a table/struct without following prototypes, since only
+ * the record's own entries are encoded.
+ */
+static Janet record_rawget(Janet record, Janet key) {
+    if (janet_checktype(record, JANET_TABLE)) return janet_table_rawget(janet_unwrap_table(record), key);
+    return janet_struct_rawget(janet_unwrap_struct(record), key);
+}
+/**
+ * Whether an array is worth encoding column by column: at least two
+ * dictionaries, all with exactly the same keys.
+ */
+static bool is_uniform_records(const Janet *items, int32_t len) {
+    if (len < 2) return false;
+    const JanetKV *first;
+    int32_t count, capacity;
+    if (!janet_dictionary_view(items[0], &first, &count, &capacity) || count == 0) return false;
+    for (int32_t i = 1; i < len; i++) {
+        const JanetKV *kvs;
+        int32_t other_count, other_capacity;
+        if (!janet_dictionary_view(items[i], &kvs, &other_count, &other_capacity)) return false;
+        if (other_count != count) return false;
+        for (int32_t j = 0; j < capacity; j++) {
+            if (janet_checktype(first[j].key, JANET_NIL)) continue;
+            if (janet_checktype(record_rawget(items[i], first[j].key), JANET_NIL)) return false;
+        }
+    }
+    return true;
+}
+/**
+ * Encode an array of records as an ext, whose payload is
+ * `[keys column1 column2 ...]` with each column holding one value per record.
+ *
+ * Keys are written once instead of once per record, and each column holds
+ * values of the same shape, which tends to compress well.
+ */
+static void encode_msgpack_columns(struct msgpack_encoder *encoder, const Janet *items, int32_t len, int depth) {
+    JanetBuffer *buffer = encoder->buffer;
+    // ext32, with the payload length patched in once it's known
+    janet_buffer_push_u8(buffer, 0xC9);
+    int32_t length_offset = buffer->count;
+    janet_buffer_push_bytes(buffer, (const uint8_t *) "\0\0\0", 4);
+    janet_buffer_push_u8(buffer, (uint8_t) encoder->columnar_ext);
+    int32_t payload_start = buffer->count;
+    const JanetKV *kvs;
+    int32_t count, capacity;
+    janet_dictionary_view(items[0], &kvs, &count, &capacity);
+    // Columns follow the slot order of the first record, unless that has to be canonical
+    int32_t *order;
+    if (encoder->canonical) {
+        order = sort_map_keys(encoder, kvs, count, capacity);
+    } else {
+        order = janet_smalloc(sizeof(int32_t) * (size_t) count);
+        for (int32_t j = 0, k = 0; j < capacity; j++) {
+            if (!janet_checktype(kvs[j].key, JANET_NIL)) order[k++] = j;
+        }
+    }
+    encode_msgpack_collection_length(encoder, count + 1, 0x90, 0xDC);
+    encode_msgpack_collection_length(encoder, count, 0x90, 0xDC);
+    for (int32_t j = 0; j < count; j++) {
+        encode_msgpack(encoder, kvs[order[j]].key, depth + 1);
+    }
+    for (int32_t j = 0; j < count; j++) {
+        encode_msgpack_collection_length(encoder, len, 0x90, 0xDC);
+        for (int32_t i = 0; i < len; i++) {
+            encode_msgpack(encoder, record_rawget(items[i], kvs[order[j]].key), depth + 2);
+        }
+    }
+    janet_sfree(order);
+    uint32_t payload_len = (uint32_t) (buffer->count - payload_start);
+    uint8_t *out = buffer->data + length_offset;
+    out[0] = (uint8_t) (payload_len >> 24);
+    out[1] = (uint8_t) ((payload_len >> 16) & 0xFF);
+    out[2] = (uint8_t) ((payload_len >> 8) & 0xFF);
+    out[3] = (uint8_t) (payload_len & 0xFF);
+}
 union byteify {
     uint64_t val;
     char bytes[8];
@@ -300,6 +1104,54 @@ static void encode_msgpack_string(struct msgpack_encoder *encoder, const uint8_t
         janet_buffer_push_bytes(buffer, bytes, len);
     }
 }
+static void encode_msgpack_ext(struct msgpack_encoder *encoder, int8_t exttype, const uint8_t *data, uint32_t len) {
+    JanetBuffer *buffer = encoder->buffer;
+    switch (len) {
+        case 1: janet_buffer_push_u8(buffer, 0xD4); break;
+        case 2: janet_buffer_push_u8(buffer, 0xD5); break;
+        case 4: janet_buffer_push_u8(buffer, 0xD6); break;
+        case 8: janet_buffer_push_u8(buffer, 0xD7); break;
+        case 16: janet_buffer_push_u8(buffer, 0xD8); break;
+        default:
+            if (len <= 0xFF) {
+                encode_int_tagged(buffer, len, 1, 0xC7);
+            } else if (len <= 0xFFFF) {
+                encode_int_tagged(buffer, len, 2, 0xC7);
+            } else {
+                encode_int_tagged(buffer, len, 4, 0xC7);
+            }
+            break;
+    }
+    janet_buffer_push_u8(buffer, (uint8_t) exttype);
+    janet_buffer_push_bytes(buffer, data, (int32_t) len);
+}
+/**
+ * Encode a timestamp using the smallest of the 32/64/96-bit forms that fits.
+ */
+static void encode_msgpack_timestamp(struct msgpack_encoder *encoder, const struct msgpack_timestamp *timestamp) {
+    JanetBuffer *buffer = encoder->buffer;
+    uint64_t seconds = (uint64_t) timestamp->seconds;
+    if (timestamp->seconds >= 0 && (seconds >> 34) == 0) {
+        if (timestamp->nanoseconds == 0 && (seconds >> 32) == 0) {
+            // fixext 4
+            janet_buffer_push_u8(buffer, 0xD6);
+            janet_buffer_push_u8(buffer, (uint8_t) MSGPACK_EXT_TIMESTAMP);
+            encode_int_without_tag(buffer, seconds, 4);
+        } else {
+            // fixext 8
+            janet_buffer_push_u8(buffer, 0xD7);
+            janet_buffer_push_u8(buffer, (uint8_t) MSGPACK_EXT_TIMESTAMP);
+            encode_int_without_tag(buffer, ((uint64_t) timestamp->nanoseconds << 34) | seconds, 8);
+        }
+    } else {
+        // ext 8 with a 12 byte payload
+        janet_buffer_push_u8(buffer, 0xC7);
+        janet_buffer_push_u8(buffer, 12);
+        janet_buffer_push_u8(buffer, (uint8_t) MSGPACK_EXT_TIMESTAMP);
+        encode_int_without_tag(buffer, timestamp->nanoseconds, 4);
+        encode_int_without_tag(buffer, seconds, 8);
+    }
+}
 static void encode_msgpack_int(struct msgpack_encoder *encoder, int64_t signed_value, bool actually_unsigned) {
     JanetBuffer *buffer = encoder->buffer;
     union byteify byteify = {.val=(uint64_t) signed_value};
@@ -311,11 +1163,11 @@ static void encode_msgpack_int(struct msgpack_encoder *encoder, int64_t signed_v
             janet_buffer_push_u8(buffer, (uint8_t) value);
         } else {
             uint8_t needed_bytes;
-            if (signed_value <= 0xFF) {
+            if (value <= 0xFF) {
                 needed_bytes = 1;
-            } else if (signed_value <= 0xFFFF) {
+            } else if (value <= 0xFFFF) {
                 needed_bytes = 2;
-            } else if (signed_value <= 0xFFFFFFFF) {
+            } else if (value <= 0xFFFFFFFF) {
                 needed_bytes = 4;
             } else {
                 needed_bytes = 8;
@@ -347,75 +1199,455 @@ static void encode_msgpack_int(struct msgpack_encoder *encoder, int64_t signed_v
     }
 }
 
+/**
+ * Parse the `encoded-string-type` argument of encode
+ */
+static void parse_encoded_types(struct msgpack_encoder *encoder, Janet types) {
+    const JanetKV *jstruct = NULL;
+    switch (janet_type(types)) {
+        case JANET_NIL:
+            break;
+        case JANET_SYMBOL:
+        case JANET_KEYWORD:
+            encoder->string_type = (enum msgpack_string_type) parse_named_enum(
+                types, "msgpack string type ('string or 'bytes)",
+                MSGPACK_STRING_TYPE_ENUM
+            );
+            encoder->buffer_type = encoder->string_type;
+            break;
+        case JANET_TABLE:
+            jstruct = janet_table_to_struct(janet_unwrap_table(types));
+        case JANET_STRUCT: {
+            if (janet_type(types) == JANET_STRUCT) {
+                // Guard against the fallthrough ;)
+                assert(jstruct == NULL);
+                jstruct = janet_unwrap_struct(types);
+            }
+            assert(jstruct != NULL);
+            int32_t capacity = janet_struct_capacity(jstruct);
+            for (int32_t i = 0; i < capacity; i++) {
+                JanetKV kv = jstruct[i];
+                if (janet_checktype(kv.key, JANET_NIL)) continue;
+                JanetType type_key = (JanetType) parse_named_enum(
+                    kv.key, "Janet type name",
+                    JANET_TYPE_ENUM
+                );
+                enum msgpack_string_type type_value = (enum msgpack_string_type) parse_named_enum(
+                    kv.value, "msgpack string type",
+                    MSGPACK_STRING_TYPE_ENUM
+                );
+                switch (type_key) {
+                    case JANET_STRING:
+                        encoder->string_type = type_value;
+                        break;
+                    case JANET_BUFFER:
+                        encoder->buffer_type = type_value;
+                        break;
+                    default:
+                        janet_panicf("Expected either 'string or 'buffer, but got %T", type_key);
+                }
+            }
+            break;
+        }
+        default:
+            janet_panicf("Expected either a keyword, symbol, table or struct, but got %t", types);
+            break;
+    }
+}
+static Janet get_option(Janet options, const char *name);
+static int8_t get_ext_type_option(Janet options, const char *name, int8_t dflt);
+/**
+ * Parse the `options` argument of encode
+ */
+static void parse_encode_options(struct msgpack_encoder *encoder, Janet options) {
+    switch (janet_type(options)) {
+        case JANET_NIL:
+        case JANET_TABLE:
+        case JANET_STRUCT:
+            break;
+        default:
+            janet_panicf("Expected encode options to be a table or struct, but got %t", options);
+    }
+    Janet registry = get_option(options, "ext");
+    if (!janet_checktype(registry, JANET_NIL)) {
+        encoder->registry = janet_getabstract(&registry, 0, &msgpack_ext_registry_type);
+    }
+    Janet dictionary = get_option(options, "dictionary");
+    if (!janet_checktype(dictionary, JANET_NIL)) {
+        encoder->dictionary = janet_getabstract(&dictionary, 0, &msgpack_dictionary_type);
+    }
+    encoder->message_start = encoder->buffer->count;
+    if (janet_truthy(get_option(options, "dedupe"))) encoder->dedupe = janet_table(0);
+    encoder->dedupe_ext = get_ext_type_option(options, "dedupe-ext", MSGPACK_EXT_BACKREF);
+    if (janet_truthy(get_option(options, "shared"))) encoder->shared = janet_table(0);
+    encoder->shared_ext = get_ext_type_option(options, "shared-ext", MSGPACK_EXT_SHARED);
+    encoder->canonical = janet_truthy(get_option(options, "canonical"));
+    encoder->columnar = janet_truthy(get_option(options, "columnar"));
+    encoder->columnar_ext = get_ext_type_option(options, "columnar-ext", MSGPACK_EXT_COLUMNS);
+}
 static Janet janet_msgpack_encode(int32_t argc, Janet *argv) {
-    janet_arity(argc, 1, 3);
+    janet_arity(argc, 1, 4);
     JanetBuffer *buffer = janet_optbuffer(argv, argc, 2, 32);
     struct msgpack_encoder encoder = {
         .buffer = buffer,
         .string_type = MSGPACK_STRING_STRING,
         .buffer_type = MSGPACK_BYTES_STRING,
     };
-    if (argc > 1) {
-        const JanetKV *jstruct = NULL;
-        switch (janet_type(argv[1])) {
-            case JANET_SYMBOL:
-            case JANET_KEYWORD:
-                encoder.string_type = (enum msgpack_string_type) parse_named_enum(
-                    argv[1], "msgpack string type ('string or 'bytes)",
-                    MSGPACK_STRING_TYPE_ENUM
-                );
-                encoder.buffer_type = encoder.string_type;
-                break;
-            case JANET_TABLE:
-                jstruct = janet_table_to_struct(janet_unwrap_table(argv[1]));
-            case JANET_STRUCT: {
-                if (janet_type(argv[1]) == JANET_STRUCT) {
-                    // Guard against the fallthrough ;)
-                    assert(jstruct == NULL);
-                    jstruct = janet_unwrap_struct(argv[1]);
-                }
-                assert(jstruct != NULL);
-                int32_t capacity = janet_struct_capacity(jstruct);
-                for (int32_t i = 0; i < capacity; i++) {
-                    JanetKV kv = jstruct[i];
-                    if (janet_checktype(kv.key, JANET_NIL)) continue;
-                    JanetType type_key = (JanetType) parse_named_enum(
-                        kv.key, "Janet type name",
-                        JANET_TYPE_ENUM
-                    );
-                    enum msgpack_string_type type_value = (enum msgpack_string_type) parse_named_enum(
-                        kv.value, "msgpack string type",
-                        MSGPACK_STRING_TYPE_ENUM
-                    );
-                    switch (type_key) {
-                        case JANET_STRING:
-                            encoder.string_type = type_value;
-                            break;
-                        case JANET_BUFFER:
-                            encoder.buffer_type = type_value;
-                            break;
-                        default:
-                            janet_panicf("Expected either 'string or 'buffer, but got %T", type_key);
-                    }
-                }
-                break;
-            }
-            default:
-                janet_panicf("Expected either a keyword, symbol, table or struct, but got %t", argv[1]);
-                break;
-        }
-
-    }
+    if (argc > 1) parse_encoded_types(&encoder, argv[1]);
+    if (argc > 3) parse_encode_options(&encoder, argv[3]);
     encode_msgpack(&encoder, argv[0], 0);
     return janet_wrap_buffer(buffer);
 }
 
+/************/
+/* Builders */
+/************/
+
+/*
+ * Incremental encoding of an array or map whose length isn't known up front,
+ * such as rows read from a cursor. The header is reserved at full width and
+ * patched (then compacted) when the builder is ended.
+ */
+
+struct msgpack_builder {
+    struct msgpack_encoder encoder;
+    // The enclosing builder, if this one is nested
+    struct msgpack_builder *parent;
+    int32_t header;
+    uint32_t count;
+    bool is_map;
+    bool has_open_child;
+    bool finished;
+};
+
+static int builder_gcmark(void *p, size_t len) {
+    (void) len;
+    struct msgpack_builder *builder = p;
+    janet_mark(janet_wrap_buffer(builder->encoder.buffer));
+    if (builder->parent != NULL) janet_mark(janet_wrap_abstract(builder->parent));
+    if (builder->encoder.registry != NULL) janet_mark(janet_wrap_abstract(builder->encoder.registry));
+    if (builder->encoder.dictionary != NULL) janet_mark(janet_wrap_abstract(builder->encoder.dictionary));
+    if (builder->encoder.dedupe != NULL) janet_mark(janet_wrap_table(builder->encoder.dedupe));
+    if (builder->encoder.shared != NULL) janet_mark(janet_wrap_table(builder->encoder.shared));
+    return 0;
+}
+static int builder_get(void *p, Janet key, Janet *out);
+static const JanetAbstractType msgpack_builder_type = {
+    "msgpack/builder",
+    NULL,
+    builder_gcmark,
+    builder_get,
+    JANET_ATEND_GET
+};
+
+static struct msgpack_builder *new_builder(struct msgpack_encoder encoder, struct msgpack_builder *parent, bool is_map) {
+    struct msgpack_builder *builder = janet_abstract(&msgpack_builder_type, sizeof(struct msgpack_builder));
+    builder->encoder = encoder;
+    builder->parent = parent;
+    builder->count = 0;
+    builder->is_map = is_map;
+    builder->has_open_child = false;
+    builder->finished = false;
+    builder->header = reserve_msgpack_collection(&builder->encoder);
+    return builder;
+}
+
+/**
+ * Get a builder that can accept another element.
+ */
+static struct msgpack_builder *get_open_builder(const Janet *argv, int32_t n) {
+    struct msgpack_builder *builder = janet_getabstract(argv, n, &msgpack_builder_type);
+    if (builder->finished) janet_panic("Builder has already ended");
+    if (builder->has_open_child) janet_panic("Builder has a nested builder that has not ended");
+    if (builder->count == UINT32_MAX) janet_panic("Too many elements for a msgpack array or map");
+    return builder;
+}
+
+static Janet cfun_builder_push(int32_t argc, Janet *argv) {
+    struct msgpack_builder *builder = get_open_builder(argv, 0);
+    if (builder->is_map) {
+        janet_fixarity(argc, 3);
+        encode_msgpack(&builder->encoder, argv[1], 0);
+        encode_msgpack(&builder->encoder, argv[2], 0);
+    } else {
+        janet_fixarity(argc, 2);
+        encode_msgpack(&builder->encoder, argv[1], 0);
+    }
+    builder->count++;
+    return argv[0];
+}
+
+static Janet begin_nested(int32_t argc, Janet *argv, bool is_map) {
+    struct msgpack_builder *parent = get_open_builder(argv, 0);
+    if (parent->is_map) {
+        janet_fixarity(argc, 2);
+        encode_msgpack(&parent->encoder, argv[1], 0);
+    } else {
+        janet_fixarity(argc, 1);
+    }
+    parent->count++;
+    parent->has_open_child = true;
+    return janet_wrap_abstract(new_builder(parent->encoder, parent, is_map));
+}
+static Janet cfun_builder_begin_array(int32_t argc, Janet *argv) {
+    return begin_nested(argc, argv, false);
+}
+static Janet cfun_builder_begin_map(int32_t argc, Janet *argv) {
+    return begin_nested(argc, argv, true);
+}
+
+static Janet cfun_builder_end(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    struct msgpack_builder *builder = janet_getabstract(argv, 0, &msgpack_builder_type);
+    if (builder->finished) janet_panic("Builder has already ended");
+    if (builder->has_open_child) janet_panic("Builder has a nested builder that has not ended");
+    if (builder->is_map && builder->encoder.canonical) {
+        // Entries arrive in any order, so sort them once they're all there
+        sort_encoded_map_entries(builder->encoder.buffer, builder->header + 5, builder->count);
+    }
+    finish_msgpack_collection(&builder->encoder, builder->header, builder->count, builder->is_map);
+    builder->finished = true;
+    if (builder->parent != NULL) builder->parent->has_open_child = false;
+    return janet_wrap_buffer(builder->encoder.buffer);
+}
+
+static Janet cfun_builder_count(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    struct msgpack_builder *builder = janet_getabstract(argv, 0, &msgpack_builder_type);
+    return janet_wrap_number((double) builder->count);
+}
+
+static const JanetMethod builder_methods[] = {
+    {"push", cfun_builder_push},
+    {"begin-array", cfun_builder_begin_array},
+    {"begin-map", cfun_builder_begin_map},
+    {"end", cfun_builder_end},
+    {"count", cfun_builder_count},
+    {NULL, NULL}
+};
+static int builder_get(void *p, Janet key, Janet *out) {
+    (void) p;
+    if (!janet_checktype(key, JANET_KEYWORD)) return 0;
+    return janet_getmethod(janet_unwrap_keyword(key), builder_methods, out);
+}
+
+static Janet begin_builder(int32_t argc, Janet *argv, bool is_map) {
+    janet_arity(argc, 0, 3);
+    struct msgpack_encoder encoder = {
+        .buffer = janet_optbuffer(argv, argc, 1, 32),
+        .string_type = MSGPACK_STRING_STRING,
+        .buffer_type = MSGPACK_BYTES_STRING,
+    };
+    if (argc > 0) parse_encoded_types(&encoder, argv[0]);
+    if (argc > 2) parse_encode_options(&encoder, argv[2]);
+    /*
+     * Sorting entries would move the values that references point at, and
+     * sorts dictionary references by their own bytes rather than the key's.
+     */
+    if (encoder.canonical && (encoder.dedupe != NULL || encoder.shared != NULL || encoder.dictionary != NULL)) {
+        janet_panic("Builders can't combine :canonical with :dedupe, :shared or :dictionary");
+    }
+    return janet_wrap_abstract(new_builder(encoder, NULL, is_map));
+}
+static Janet janet_msgpack_begin_array(int32_t argc, Janet *argv) {
+    return begin_builder(argc, argv, false);
+}
+static Janet janet_msgpack_begin_map(int32_t argc, Janet *argv) {
+    return begin_builder(argc, argv, true);
+}
+
+/*****************/
+/* Mapped Files  */
+/*****************/
+
+/*
+ * A read-only memory mapping of a file, unmapped when garbage collected.
+ *
+ * Anything that reads msgpack accepts a mapping in place of a string, so
+ * large files are paged in on demand instead of being copied up front.
+ */
+struct msgpack_mapping {
+    const uint8_t *data;
+    size_t len;
+};
+
+static int mapping_gc(void *p, size_t len) {
+    (void) len;
+    struct msgpack_mapping *mapping = p;
+    if (mapping->data != NULL) {
+        #ifdef _WIN32
+            UnmapViewOfFile((LPCVOID) mapping->data);
+        #else
+            munmap((void*) mapping->data, mapping->len);
+        #endif
+        mapping->data = NULL;
+    }
+    return 0;
+}
+static int mapping_get(void *p, Janet key, Janet *out);
+static const JanetAbstractType msgpack_mapping_type = {
+    "msgpack/mapping",
+    mapping_gc,
+    NULL,
+    mapping_get,
+    JANET_ATEND_GET
+};
+static Janet cfun_mapping_length(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    struct msgpack_mapping *mapping = janet_getabstract(argv, 0, &msgpack_mapping_type);
+    return janet_wrap_number((double) mapping->len);
+}
+static const JanetMethod mapping_methods[] = {
+    {"length", cfun_mapping_length},
+    {NULL, NULL}
+};
+static int mapping_get(void *p, Janet key, Janet *out) {
+    (void) p;
+    if (!janet_checktype(key, JANET_KEYWORD)) return 0;
+    return janet_getmethod(janet_unwrap_keyword(key), mapping_methods, out);
+}
+
+/**
+ * Map the file at path into memory, panicking on failure.
+ */
+static void map_file(struct msgpack_mapping *mapping, const char *path) {
+    mapping->data = NULL;
+    mapping->len = 0;
+    #ifdef _WIN32
+        HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) janet_panicf("Unable to open %s", path);
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size)) {
+            CloseHandle(file);
+            janet_panicf("Unable to get the size of %s", path);
+        }
+        if (size.QuadPart == 0) {
+            CloseHandle(file);
+            return;
+        }
+        HANDLE view = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        CloseHandle(file);
+        if (view == NULL) janet_panicf("Unable to map %s", path);
+        const void *data = MapViewOfFile(view, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(view);
+        if (data == NULL) janet_panicf("Unable to map %s", path);
+        mapping->data = data;
+        mapping->len = (size_t) size.QuadPart;
+    #else
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) janet_panicf("Unable to open %s: %s", path, strerror(errno));
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            close(fd);
+            janet_panicf("Unable to stat %s: %s", path, strerror(errno));
+        }
+        if (info.st_size == 0) {
+            close(fd);
+            return;
+        }
+        void *data = mmap(NULL, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) janet_panicf("Unable to map %s: %s", path, strerror(errno));
+        mapping->data = data;
+        mapping->len = (size_t) info.st_size;
+    #endif
+}
+
+/**
+ * View the bytes of a string/buffer/keyword/symbol, a file mapping or a raw value.
+ */
+static void msgpack_bytes_view(Janet value, const uint8_t **data, size_t *len) {
+    struct msgpack_mapping *mapping;
+    struct msgpack_raw *raw;
+    if (janet_checktype(value, JANET_ABSTRACT)) {
+        if ((mapping = janet_checkabstract(value, &msgpack_mapping_type)) != NULL) {
+            *data = mapping->data;
+            *len = mapping->len;
+            return;
+        } else if ((raw = janet_checkabstract(value, &msgpack_raw_type)) != NULL) {
+            value = raw->bytes;
+        }
+    }
+    int32_t view_len;
+    if (!janet_bytes_view(value, data, &view_len)) {
+        janet_panicf("Expected bytes or a file mapping, but got %t", value);
+    }
+    *len = (size_t) view_len;
+}
+
+/**
+ * Per-call resource limits for decoding untrusted input.
+ *
+ * A negative limit means "unlimited".
+ */
+struct msgpack_decode_limits {
+    int64_t max_elements;
+    int64_t max_bytes;
+    int64_t max_string;
+    int32_t max_depth;
+};
+/**
+ * Running totals for a single decode call, checked against the limits.
+ *
+ * The byte count is an estimate of what the decoded Janet values occupy,
+ * not an exact figure from the allocator.
+ */
+struct msgpack_decode_stats {
+    int64_t elements;
+    int64_t bytes;
+    int32_t depth;
+    // Input bytes claimed by the container headers seen so far
+    uint64_t claimed;
+};
+/*
+ * How to decode arrays that were encoded column by column.
+ */
+enum msgpack_columnar_mode {
+    // Not expected, so they're an unsupported ext type
+    MSGPACK_COLUMNAR_OFF = 0,
+    // Rebuilt into the original array of records
+    MSGPACK_COLUMNAR_ROWS = 1,
+    // Left as a map of key -> array of values
+    MSGPACK_COLUMNAR_COLUMNS = 2
+};
+static const struct enum_entry MSGPACK_COLUMNAR_MODE_ENUM[] = {
+    {"rows", MSGPACK_COLUMNAR_ROWS},
+    {"columns", MSGPACK_COLUMNAR_COLUMNS},
+    {NULL, 0}
+};
 struct janet_msgpack_decoder {
     mpack_reader_t *reader;
     JanetType string_type;
     enum janet_type_mutability bin_type;
     enum janet_type_mutability array_type;
     enum janet_type_mutability map_type;
+    enum msgpack_timestamp_type timestamp_type;
+    // Optional, used to decode application-defined ext types
+    struct msgpack_ext_registry *registry;
+    // Optional, used to resolve references to common strings
+    struct msgpack_dictionary *dictionary;
+    // Whether to resolve back-references, which are offsets into the whole message
+    bool dedupe;
+    int8_t dedupe_ext;
+    const uint8_t *message;
+    size_t message_len;
+    // Maps offsets -> strings already resolved
+    JanetTable *backrefs;
+    // Whether to resolve references to shared containers, also offsets into the whole message
+    bool shared;
+    int8_t shared_ext;
+    // Maps offsets -> containers decoded there (false while an immutable one is being built)
+    JanetTable *shared_values;
+    // Optional set of map keys whose values are kept as raw msgpack, at any depth
+    JanetTable *raw_keys;
+    // Optional paths of map keys whose values are kept as raw msgpack, like :only
+    JanetTable *raw_paths;
+    // Optional projection of the map keys to decode (NULL decodes everything)
+    JanetTable *only;
+    enum msgpack_columnar_mode columnar;
+    int8_t columnar_ext;
+    struct msgpack_decode_limits limits;
+    struct msgpack_decode_stats stats;
 };
 
 static int32_t check_length_cast(uint32_t len) {
@@ -424,20 +1656,376 @@ static int32_t check_length_cast(uint32_t len) {
     }
     return (int32_t) len;
 }
-static Janet decode_msgpack_string(struct janet_msgpack_decoder *decoder, uint32_t len, enum msgpack_string_type string_type) {
+/**
+ * Count elements & allocations against the decode limits.
+ */
+static void account_decoded_elements(struct janet_msgpack_decoder *decoder, int64_t count, size_t alloc_bytes) {
+    struct msgpack_decode_stats *stats = &decoder->stats;
+    stats->elements += count;
+    stats->bytes += (int64_t) alloc_bytes;
+    if (decoder->limits.max_elements >= 0 && stats->elements > decoder->limits.max_elements) {
+        janet_panicf("Exceeded decode limit of %v total elements", janet_wrap_number((double) decoder->limits.max_elements));
+    }
+    if (decoder->limits.max_bytes >= 0 && stats->bytes > decoder->limits.max_bytes) {
+        janet_panicf("Exceeded decode limit of %v allocated bytes", janet_wrap_number((double) decoder->limits.max_bytes));
+    }
+}
+/**
+ * Account for a container of `count` elements before pre-sizing it.
+ *
+ * Every element takes at least `min_bytes_each` bytes of input, so a header
+ * claiming more elements than the remaining input could possibly hold is
+ * rejected here instead of being passed on to janet_array/janet_struct_begin.
+ *
+ * Nested headers can each claim most of the same remaining input, so the
+ * claims are also totalled: no element belongs to two containers, and the
+ * total can't exceed the whole message.
+ */
+static void decode_msgpack_reserve(struct janet_msgpack_decoder *decoder, int32_t count, size_t min_bytes_each, size_t alloc_bytes) {
+    size_t remaining = mpack_reader_remaining(decoder->reader, NULL);
+    if ((size_t) count > remaining / min_bytes_each) {
+        janet_panicf("Container claims %d elements, but only %d bytes of input remain", count, (int32_t) (remaining > INT32_MAX ? INT32_MAX : remaining));
+    }
+    decoder->stats.claimed += (uint64_t) count * min_bytes_each;
+    if (decoder->message != NULL && decoder->stats.claimed > decoder->message_len) {
+        janet_panicf("Containers claim %v bytes in total, but the input is only %v bytes",
+            janet_wrap_number((double) decoder->stats.claimed), janet_wrap_number((double) decoder->message_len));
+    }
+    account_decoded_elements(decoder, count, alloc_bytes);
+}
+static void account_decoded_string(struct janet_msgpack_decoder *decoder, uint32_t len) {
     check_length_cast(len);
-    mpack_reader_t *reader = decoder->reader;
-    JanetType decoded_type = decoder->string_type;
+    if (decoder->limits.max_string >= 0 && (int64_t) len > decoder->limits.max_string) {
+        janet_panicf("String of %d bytes exceeds decode limit of %v", (int32_t) len, janet_wrap_number((double) decoder->limits.max_string));
+    }
+    decoder->stats.bytes += len;
+    if (decoder->limits.max_bytes >= 0 && decoder->stats.bytes > decoder->limits.max_bytes) {
+        janet_panicf("Exceeded decode limit of %v allocated bytes", janet_wrap_number((double) decoder->limits.max_bytes));
+    }
+}
+static JanetType decoded_string_type(struct janet_msgpack_decoder *decoder, enum msgpack_string_type string_type) {
     switch (string_type) {
         case MSGPACK_STRING_STRING:
-            decoded_type = decoder->string_type;
-            break;
+            return decoder->string_type;
         case MSGPACK_BYTES_STRING:
-            decoded_type = decoder->bin_type == JANET_TYPE_MUTABLE ? JANET_BUFFER : JANET_STRING;
-            break;
+            return decoder->bin_type == JANET_TYPE_MUTABLE ? JANET_BUFFER : JANET_STRING;
         default:
             assert(false);
+            return JANET_STRING;
+    }
+}
+static Janet wrap_decoded_string(JanetType decoded_type, const char *data, uint32_t len) {
+    switch (decoded_type) {
+        case JANET_STRING:
+            return janet_wrap_string(janet_string((uint8_t*) data, len));
+        case JANET_BUFFER: {
+            JanetBuffer *buffer = janet_buffer((int32_t) len);
+            janet_buffer_push_bytes(buffer, (const uint8_t*) data, (int32_t) len);
+            return janet_wrap_buffer(buffer);
+        }
+        case JANET_SYMBOL:
+            return janet_symbolv((const uint8_t*) data, len);
+        case JANET_KEYWORD:
+            return janet_keywordv((const uint8_t*) data, len);
+        default:
+            janet_panicf("Unsupported string type: %T", decoded_type);
+    }
+}
+static Janet wrap_decoded_int(int64_t value) {
+    if (value >= (int64_t) INT32_MIN && value <= (int64_t) INT32_MAX) {
+        return janet_wrap_integer((int32_t) value);
+    } else {
+        #ifdef JANET_INT_TYPES
+            return janet_wrap_s64(value);
+        #else
+            return janet_panic("64-bit numbers are too large")
+        #endif
+    }
+}
+static Janet wrap_decoded_uint(uint64_t value) {
+    if (value <= (uint64_t) INT32_MAX) {
+        return janet_wrap_integer((int32_t) value);
+    } else {
+        #ifdef JANET_INT_TYPES
+            return janet_wrap_u64(value);
+        #else
+            return janet_panic("64-bit numbers are too large")
+        #endif
+    }
+}
+/**
+ * Map keys are decoded as keywords, so keys given as strings in options are converted to match.
+ */
+static Janet normalize_map_key(Janet key) {
+    if (janet_checktype(key, JANET_STRING)) {
+        return janet_keywordv(janet_unwrap_string(key), janet_string_length(janet_unwrap_string(key)));
     }
+    return key;
+}
+/**
+ * Check whether the value of a map key is wanted by the :only projection.
+ *
+ * If so, the decoder's projection is narrowed to what's wanted inside the value,
+ * and the caller restores it afterwards.
+ */
+static bool enter_projection(struct janet_msgpack_decoder *decoder, JanetTable *only, Janet key) {
+    Janet projection = janet_table_get(only, key);
+    if (janet_checktype(projection, JANET_NIL)) return false;
+    decoder->only = janet_checktype(projection, JANET_TABLE) ? janet_unwrap_table(projection) : NULL;
+    return true;
+}
+/**
+ * Check whether the value of a map key should be kept as raw msgpack.
+ *
+ * If not, the decoder's :raw paths are narrowed to the ones inside the value,
+ * and the caller restores them afterwards.
+ */
+static bool enter_raw_paths(struct janet_msgpack_decoder *decoder, JanetTable *raw_paths, Janet key) {
+    if (decoder->raw_keys != NULL && !janet_checktype(janet_table_get(decoder->raw_keys, key), JANET_NIL)) return true;
+    if (raw_paths == NULL) return false;
+    Janet path = janet_table_get(raw_paths, key);
+    if (janet_checktype(path, JANET_BOOLEAN)) return true;
+    decoder->raw_paths = janet_checktype(path, JANET_TABLE) ? janet_unwrap_table(path) : NULL;
+    return false;
+}
+static Janet decode_msgpack(struct janet_msgpack_decoder *decoder, int depth);
+static void janet_msgpack_error_handler(mpack_reader_t *reader, mpack_error_t error);
+/**
+ * Decode the payload of a columnar ext (`[keys column1 column2 ...]`),
+ * either back into rows or as a map of key -> column.
+ *
+ * The :only projection and :raw keys apply to the keys of the records.
+ */
+static Janet decode_msgpack_columns(struct janet_msgpack_decoder *decoder, const uint8_t *data, uint32_t len, int depth) {
+    mpack_reader_t reader;
+    mpack_reader_init_data(&reader, (const char*) data, len);
+    mpack_reader_set_error_handler(&reader, janet_msgpack_error_handler);
+    mpack_reader_t *outer_reader = decoder->reader;
+    decoder->reader = &reader;
+    JanetTable *only = decoder->only;
+    JanetTable *raw_paths = decoder->raw_paths;
+    mpack_tag_t tag = mpack_read_tag(&reader);
+    if (mpack_tag_type(&tag) != mpack_type_array || mpack_tag_array_count(&tag) == 0) {
+        janet_panic("Error decoding msgpack: invalid columnar payload");
+    }
+    int32_t width = check_length_cast(mpack_tag_array_count(&tag) - 1);
+    decode_msgpack_reserve(decoder, width, 2, (size_t) width * 2 * sizeof(Janet));
+    tag = mpack_read_tag(&reader);
+    if (mpack_tag_type(&tag) != mpack_type_array || mpack_tag_array_count(&tag) != (uint32_t) width) {
+        janet_panic("Error decoding msgpack: invalid columnar payload");
+    }
+    Janet *keys = janet_smalloc(sizeof(Janet) * (size_t) (width ? width : 1));
+    JanetType old_string_type = decoder->string_type;
+    decoder->string_type = JANET_KEYWORD;
+    for (int32_t j = 0; j < width; j++) keys[j] = decode_msgpack(decoder, depth + 2);
+    decoder->string_type = old_string_type;
+    mpack_done_array(&reader);
+    // Skipped columns are left as NULL
+    JanetArray **columns = janet_smalloc(sizeof(JanetArray *) * (size_t) (width ? width : 1));
+    int32_t rows = -1, kept = 0;
+    for (int32_t j = 0; j < width; j++) {
+        columns[j] = NULL;
+        if (only != NULL && !enter_projection(decoder, only, keys[j])) {
+            if (rows >= 0) {
+                mpack_discard(&reader);
+                continue;
+            }
+            // The row count is still needed, even if every column is skipped
+            tag = mpack_read_tag(&reader);
+            if (mpack_tag_type(&tag) != mpack_type_array) janet_panic("Error decoding msgpack: invalid columnar payload");
+            rows = check_length_cast(mpack_tag_array_count(&tag));
+            for (int32_t i = 0; i < rows; i++) mpack_discard(&reader);
+            mpack_done_array(&reader);
+            continue;
+        }
+        tag = mpack_read_tag(&reader);
+        if (mpack_tag_type(&tag) != mpack_type_array || (rows >= 0 && mpack_tag_array_count(&tag) != (uint32_t) rows)) {
+            janet_panic("Error decoding msgpack: invalid columnar payload");
+        }
+        rows = check_length_cast(mpack_tag_array_count(&tag));
+        decode_msgpack_reserve(decoder, rows, 1, (size_t) rows * sizeof(Janet));
+        JanetArray *column = janet_array(rows);
+        bool raw = enter_raw_paths(decoder, raw_paths, keys[j]);
+        for (int32_t i = 0; i < rows; i++) {
+            if (raw) {
+                const char *start;
+                size_t before = mpack_reader_remaining(&reader, &start);
+                mpack_discard(&reader);
+                janet_array_push(column, wrap_raw((const uint8_t*) start, before - mpack_reader_remaining(&reader, NULL)));
+            } else {
+                janet_array_push(column, decode_msgpack(decoder, depth + 2));
+            }
+        }
+        mpack_done_array(&reader);
+        decoder->only = only;
+        decoder->raw_paths = raw_paths;
+        columns[j] = column;
+        kept++;
+    }
+    mpack_done_array(&reader);
+    decoder->reader = outer_reader;
+    if (rows < 0) rows = 0;
+    Janet result;
+    if (decoder->columnar == MSGPACK_COLUMNAR_COLUMNS) {
+        JanetTable *table = janet_table(kept);
+        for (int32_t j = 0; j < width; j++) {
+            if (columns[j] == NULL) continue;
+            Janet column = decoder->array_type == JANET_TYPE_MUTABLE
+                ? janet_wrap_array(columns[j])
+                : janet_wrap_tuple(janet_tuple_n(columns[j]->data, columns[j]->count));
+            janet_table_put(table, keys[j], column);
+        }
+        result = decoder->map_type == JANET_TYPE_MUTABLE
+            ? janet_wrap_table(table)
+            : janet_wrap_struct(janet_table_to_struct(table));
+    } else {
+        account_decoded_elements(decoder, (int64_t) rows * (kept + 1), (size_t) rows * ((size_t) kept * 2 * sizeof(JanetKV) + sizeof(Janet)));
+        JanetArray *records = janet_array(rows);
+        for (int32_t i = 0; i < rows; i++) {
+            Janet record;
+            if (decoder->map_type == JANET_TYPE_MUTABLE) {
+                JanetTable *table = janet_table(kept);
+                for (int32_t j = 0; j < width; j++) {
+                    if (columns[j] != NULL) janet_table_put(table, keys[j], columns[j]->data[i]);
+                }
+                record = janet_wrap_table(table);
+            } else {
+                JanetKV *st = janet_struct_begin(kept);
+                for (int32_t j = 0; j < width; j++) {
+                    if (columns[j] != NULL) janet_struct_put(st, keys[j], columns[j]->data[i]);
+                }
+                record = janet_wrap_struct(janet_struct_end(st));
+            }
+            janet_array_push(records, record);
+        }
+        result = decoder->array_type == JANET_TYPE_MUTABLE
+            ? janet_wrap_array(records)
+            : janet_wrap_tuple(janet_tuple_n(records->data, records->count));
+    }
+    janet_sfree(columns);
+    janet_sfree(keys);
+    return result;
+}
+/**
+ * Resolve a dictionary reference to its (pre-built) keyword or string.
+ */
+static Janet decode_dictionary_ref(struct janet_msgpack_decoder *decoder, const uint8_t *data, uint32_t len) {
+    const struct msgpack_dictionary *dictionary = decoder->dictionary;
+    int32_t index;
+    if (len == 1) {
+        index = data[0];
+    } else if (len == 2) {
+        index = (data[0] << 8) | data[1];
+    } else {
+        janet_panic("Error decoding msgpack: invalid dictionary reference");
+    }
+    if (index >= janet_tuple_length(dictionary->strings)) {
+        janet_panicf("Error decoding msgpack: dictionary has no entry %d", index);
+    }
+    switch (decoder->string_type) {
+        case JANET_KEYWORD:
+            return dictionary->keywords[index];
+        case JANET_STRING:
+            return dictionary->strings[index];
+        default: {
+            const uint8_t *bytes = janet_unwrap_string(dictionary->strings[index]);
+            return wrap_decoded_string(decoder->string_type, (const char*) bytes, (uint32_t) janet_string_length(bytes));
+        }
+    }
+}
+/**
+ * Resolve a back-reference to the string at an earlier offset in the message.
+ */
+static Janet decode_backref(struct janet_msgpack_decoder *decoder, const uint8_t *data, uint32_t len) {
+    if (len != 1 && len != 2 && len != 4) janet_panic("Error decoding msgpack: invalid back-reference");
+    if (decoder->message == NULL) janet_panic("Error decoding msgpack: back-references can't be resolved here");
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < len; i++) offset = (offset << 8) | data[i];
+    Janet key = janet_wrap_number((double) offset);
+    if (decoder->backrefs == NULL) decoder->backrefs = janet_table(0);
+    Janet string = janet_table_get(decoder->backrefs, key);
+    if (janet_checktype(string, JANET_NIL)) {
+        if (offset >= decoder->message_len) janet_panic("Error decoding msgpack: back-reference past the end of the message");
+        mpack_reader_t reader;
+        mpack_reader_init_data(&reader, (const char*) decoder->message + offset, decoder->message_len - offset);
+        mpack_reader_set_error_handler(&reader, janet_msgpack_error_handler);
+        mpack_tag_t tag = mpack_read_tag(&reader);
+        if (mpack_tag_type(&tag) != mpack_type_str) {
+            janet_panicf("Error decoding msgpack: back-reference to offset %d is not a string", (int32_t) offset);
+        }
+        uint32_t string_len = mpack_tag_str_length(&tag);
+        account_decoded_string(decoder, string_len);
+        const char *bytes = mpack_read_bytes_inplace(&reader, (size_t) string_len);
+        string = janet_stringv((const uint8_t*) bytes, (int32_t) string_len);
+        janet_table_put(decoder->backrefs, key, string);
+    }
+    if (decoder->string_type == JANET_STRING) return string;
+    const uint8_t *bytes = janet_unwrap_string(string);
+    return wrap_decoded_string(decoder->string_type, (const char*) bytes, (uint32_t) janet_string_length(bytes));
+}
+static void share_decoded(struct janet_msgpack_decoder *decoder, size_t offset, Janet value) {
+    janet_table_put(decoder->shared_values, janet_wrap_number((double) offset), value);
+}
+/**
+ * Resolve a reference to a shared container.
+ *
+ * Containers are normally decoded before anything refers to them, but
+ * ones that were skipped (inside a :raw value, for instance) are decoded on demand.
+ */
+static Janet decode_shared_ref(struct janet_msgpack_decoder *decoder, const uint8_t *data, uint32_t len, int depth) {
+    if (len != 1 && len != 2 && len != 4) janet_panic("Error decoding msgpack: invalid shared reference");
+    if (decoder->message == NULL) janet_panic("Error decoding msgpack: shared references can't be resolved here");
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < len; i++) offset = (offset << 8) | data[i];
+    Janet value = janet_table_get(decoder->shared_values, janet_wrap_number((double) offset));
+    if (janet_checktype(value, JANET_BOOLEAN)) {
+        janet_panicf("Error decoding msgpack: cyclic reference to offset %d can't be decoded as an immutable value", (int32_t) offset);
+    }
+    if (!janet_checktype(value, JANET_NIL)) return value;
+    if (offset >= decoder->message_len) janet_panic("Error decoding msgpack: shared reference past the end of the message");
+    mpack_reader_t reader;
+    mpack_reader_init_data(&reader, (const char*) decoder->message + offset, decoder->message_len - offset);
+    mpack_reader_set_error_handler(&reader, janet_msgpack_error_handler);
+    mpack_reader_t *outer_reader = decoder->reader;
+    decoder->reader = &reader;
+    value = decode_msgpack(decoder, depth + 1);
+    decoder->reader = outer_reader;
+    return value;
+}
+static Janet decode_msgpack_ext(struct janet_msgpack_decoder *decoder, int8_t exttype, const uint8_t *data, uint32_t len, int depth) {
+    if (decoder->columnar != MSGPACK_COLUMNAR_OFF && exttype == decoder->columnar_ext) {
+        return decode_msgpack_columns(decoder, data, len, depth);
+    }
+    if (decoder->dictionary != NULL && exttype == decoder->dictionary->exttype) {
+        return decode_dictionary_ref(decoder, data, len);
+    }
+    if (decoder->dedupe && exttype == decoder->dedupe_ext) {
+        return decode_backref(decoder, data, len);
+    }
+    if (decoder->shared && exttype == decoder->shared_ext) {
+        return decode_shared_ref(decoder, data, len, depth);
+    }
+    struct msgpack_ext_registry *registry = decoder->registry;
+    if (registry != NULL && !janet_checktype(registry->decoders[(uint8_t) exttype], JANET_NIL)) {
+        Janet payload = janet_wrap_string(janet_string(data, (int32_t) len));
+        return call_ext_handler(registry->decoders[(uint8_t) exttype], registry->native_decoders[(uint8_t) exttype], payload);
+    }
+    if (exttype == MSGPACK_EXT_TIMESTAMP) {
+        struct msgpack_timestamp timestamp;
+        if (!read_msgpack_timestamp(data, len, &timestamp)) {
+            janet_panic("Error decoding msgpack: invalid timestamp");
+        }
+        if (decoder->timestamp_type == MSGPACK_TIMESTAMP_ABSTRACT) {
+            return wrap_timestamp(timestamp.seconds, timestamp.nanoseconds);
+        }
+        return janet_wrap_number((double) timestamp.seconds + timestamp.nanoseconds / 1e9);
+    }
+    janet_panicf("Unsupported msgpack extension type %d", (int32_t) exttype);
+}
+static Janet decode_msgpack_string(struct janet_msgpack_decoder *decoder, uint32_t len, enum msgpack_string_type string_type) {
+    account_decoded_string(decoder, len);
+    mpack_reader_t *reader = decoder->reader;
+    JanetType decoded_type = decoded_string_type(decoder, string_type);
     const char *data;
     switch (decoded_type) {
         // TODO: Decouple requirement of UTF8 validity from type
@@ -462,24 +2050,23 @@ static Janet decode_msgpack_string(struct janet_msgpack_decoder *decoder, uint32
         default:
             assert(false);
     }
-    switch (decoded_type) {
-        case JANET_STRING:
-            return janet_wrap_string(janet_string((uint8_t*) data, len));
-        case JANET_BUFFER: {
-            JanetBuffer *buffer = janet_buffer((int32_t) len);
-            janet_buffer_push_cstring(buffer, data);
-            return janet_wrap_buffer(buffer);
-        }
-        case JANET_SYMBOL:
-            return janet_symbolv((const uint8_t*) data, len);
-        case JANET_KEYWORD:
-            return janet_keywordv((const uint8_t*) data, len);
-        default:
-            assert(false);
+    return wrap_decoded_string(decoded_type, data, len);
+}
+static void account_decoded_depth(struct janet_msgpack_decoder *decoder, int depth) {
+    if (depth > JANET_RECURSION_GUARD) janet_panic("mspgack decoding recursed too deeply");
+    if (depth > decoder->limits.max_depth) {
+        janet_panicf("Exceeded decode limit of %d nesting levels", decoder->limits.max_depth);
     }
+    if (depth > decoder->stats.depth) decoder->stats.depth = depth;
 }
 static Janet decode_msgpack(struct janet_msgpack_decoder *decoder, int depth) {
-    if (depth > JANET_RECURSION_GUARD) janet_panic("mspgack decoding recursed too deeply");
+    account_decoded_depth(decoder, depth);
+    size_t offset = 0;
+    if (decoder->shared) {
+        const char *start;
+        mpack_reader_remaining(decoder->reader, &start);
+        offset = (size_t) ((const uint8_t*) start - decoder->message);
+    }
     mpack_tag_t tag = mpack_read_tag(decoder->reader);
     mpack_type_t decoded_type = mpack_tag_type(&tag);
     switch (decoded_type) {
@@ -487,30 +2074,10 @@ static Janet decode_msgpack(struct janet_msgpack_decoder *decoder, int depth) {
             return janet_wrap_nil();
         case mpack_type_bool:
             return janet_wrap_boolean(mpack_tag_bool_value(&tag));
-        case mpack_type_int: {
-            int64_t value = mpack_tag_int_value(&tag);
-            if (value >= (int64_t) INT32_MIN && value <= (int64_t) INT32_MAX) {
-                return janet_wrap_integer((int32_t) value);
-            } else {
-                #ifdef JANET_INT_TYPES
-                    return janet_wrap_s64(value);
-                #else
-                    return janet_panic("64-bit numbers are too large")
-                #endif
-            }
-        }
-        case mpack_type_uint: {
-            uint64_t value = mpack_tag_uint_value(&tag);
-            if (value <= (uint64_t) INT32_MAX) {
-                return janet_wrap_integer((int32_t) value);
-            } else {
-                #ifdef JANET_INT_TYPES
-                    return janet_wrap_u64(value);
-                #else
-                    return janet_panic("64-bit numbers are too large")
-                #endif
-            }
-        }
+        case mpack_type_int:
+            return wrap_decoded_int(mpack_tag_int_value(&tag));
+        case mpack_type_uint:
+            return wrap_decoded_uint(mpack_tag_uint_value(&tag));
         case mpack_type_float: {
             float value = mpack_tag_float_value(&tag);
             return janet_wrap_number(value);
@@ -529,6 +2096,7 @@ static Janet decode_msgpack(struct janet_msgpack_decoder *decoder, int depth) {
         }
         case mpack_type_array: {
             int32_t len = check_length_cast(mpack_tag_array_count(&tag));
+            decode_msgpack_reserve(decoder, len, 1, (size_t) len * sizeof(Janet));
             JanetArray *array = NULL;
             Janet *data = NULL;
             if (decoder->array_type == JANET_TYPE_MUTABLE) {
@@ -536,6 +2104,7 @@ static Janet decode_msgpack(struct janet_msgpack_decoder *decoder, int depth) {
             } else {
                 data = janet_tuple_begin(len);
             }
+            if (decoder->shared) share_decoded(decoder, offset, array != NULL ? janet_wrap_array(array) : janet_wrap_false());
             for (int32_t i = 0; i < len; i++) {
                 Janet val = decode_msgpack(decoder, depth + 1);
                 if (array != NULL) {
@@ -549,25 +2118,50 @@ static Janet decode_msgpack(struct janet_msgpack_decoder *decoder, int depth) {
                 return janet_wrap_array(array);
             } else {
                 assert(data != NULL);
-                return janet_wrap_tuple(janet_tuple_end(data));
+                Janet tuple = janet_wrap_tuple(janet_tuple_end(data));
+                if (decoder->shared) share_decoded(decoder, offset, tuple);
+                return tuple;
             }
         }
         case mpack_type_map: {
             int32_t len = check_length_cast(mpack_tag_map_count(&tag));
+            JanetTable *only = decoder->only;
+            JanetTable *raw_paths = decoder->raw_paths;
+            int32_t kept = only != NULL && only->count < len ? only->count : len;
+            // Tables and structs keep their slots at most half full
+            decode_msgpack_reserve(decoder, kept, 2, (size_t) kept * 2 * sizeof(JanetKV));
             JanetTable *table = NULL;
             JanetKV *st = NULL;
-            if (decoder->array_type == JANET_TYPE_MUTABLE) {
-                table = janet_table(len);
+            // Projected structs are built from a table, since we don't know how many keys are present
+            if (decoder->map_type == JANET_TYPE_MUTABLE || only != NULL) {
+                table = janet_table(kept);
             } else {
                 st = janet_struct_begin(len);
             }
+            if (decoder->shared) {
+                share_decoded(decoder, offset, decoder->map_type == JANET_TYPE_MUTABLE ? janet_wrap_table(table) : janet_wrap_false());
+            }
             for (int32_t i = 0; i < len; i++) {
                 // Reset string type to JANET_KEYWORD
                 JanetType old_string_type = decoder->string_type;
                 decoder->string_type = JANET_KEYWORD;
                 Janet key = decode_msgpack(decoder, depth + 1);
                 decoder->string_type = old_string_type;
-                Janet value = decode_msgpack(decoder, depth + 1);
+                if (only != NULL && !enter_projection(decoder, only, key)) {
+                    mpack_discard(decoder->reader);
+                    continue;
+                }
+                Janet value;
+                if (enter_raw_paths(decoder, raw_paths, key)) {
+                    const char *start;
+                    size_t before = mpack_reader_remaining(decoder->reader, &start);
+                    mpack_discard(decoder->reader);
+                    value = wrap_raw((const uint8_t*) start, before - mpack_reader_remaining(decoder->reader, NULL));
+                } else {
+                    value = decode_msgpack(decoder, depth + 1);
+                }
+                decoder->only = only;
+                decoder->raw_paths = raw_paths;
                 if (table != NULL) {
                     janet_table_put(table, key, value);
                 } else {
@@ -576,12 +2170,24 @@ static Janet decode_msgpack(struct janet_msgpack_decoder *decoder, int depth) {
                 }
             }
             mpack_done_map(decoder->reader);
-            if (table != NULL) {
-                return janet_wrap_table(table);
-            } else {
-                assert(st != NULL);
-                return janet_wrap_struct(janet_struct_end(st));
+            if (decoder->map_type == JANET_TYPE_MUTABLE) return janet_wrap_table(table);
+            Janet result = table != NULL
+                ? janet_wrap_struct(janet_table_to_struct(table))
+                : janet_wrap_struct(janet_struct_end(st));
+            if (decoder->shared) share_decoded(decoder, offset, result);
+            return result;
+        }
+        case mpack_type_ext: {
+            uint32_t len = mpack_tag_ext_length(&tag);
+            const char *data = mpack_read_bytes_inplace(decoder->reader, (size_t) len);
+            mpack_done_ext(decoder->reader);
+            int8_t exttype = mpack_tag_ext_exttype(&tag);
+            Janet value = decode_msgpack_ext(decoder, exttype, (const uint8_t*) data, len, depth);
+            // Arrays written column by column can be shared too
+            if (decoder->shared && decoder->columnar != MSGPACK_COLUMNAR_OFF && exttype == decoder->columnar_ext) {
+                share_decoded(decoder, offset, value);
             }
+            return value;
         }
         default:
             janet_panicf("Unsupported msgpack type: %s", mpack_type_to_string(decoded_type));
@@ -599,113 +2205,4071 @@ static void janet_msgpack_error_handler(mpack_reader_t *reader, mpack_error_t er
     const char *msg = mpack_error_to_string(error);
     janet_panicf("Error decoding msgpack: %s", msg);
 }
-static Janet janet_msgpack_decode(int32_t argc, Janet *argv) {
-    janet_arity(argc, 1, 1);
-    const uint8_t *data;
-    int32_t len;
-    janet_bytes_view(argv[0], &data, &len);
-    mpack_reader_t reader;
-    mpack_reader_init_data(&reader, (char*) data, len);
-    mpack_reader_set_error_handler(&reader, janet_msgpack_error_handler);
-    struct janet_msgpack_decoder decoder = {
-        .reader = &reader,
-        .string_type = JANET_STRING,
-        .bin_type = JANET_TYPE_MUTABLE,
-        .array_type = JANET_TYPE_MUTABLE,
-        .map_type = JANET_TYPE_MUTABLE
-    };
+/**
+ * Parse the `decoded-types` argument, mapping msgpack types -> Janet types
+ */
+static void parse_decoded_types(struct janet_msgpack_decoder *decoder, Janet types) {
     const JanetKV *jstruct = NULL;
-    if (argc > 1) {
-        switch (janet_type(argv[1])) {
-            case JANET_TABLE:
-                jstruct = janet_table_to_struct(janet_unwrap_table(argv[1]));
-            case JANET_STRUCT: {
-                if (janet_type(argv[1]) == JANET_STRUCT) {
-                    // Guard against the fallthrough ;)
-                    assert(jstruct == NULL);
-                    jstruct = janet_unwrap_struct(argv[1]);
-                }
-                assert(jstruct != NULL);
-                int32_t capacity = janet_struct_capacity(jstruct);
-                for (int32_t i = 0; i < capacity; i++) {
-                    JanetKV kv = jstruct[i];
-                    if (janet_checktype(kv.key, JANET_NIL)) continue;
-                    mpack_type_t msgpack_type = (mpack_type_t) parse_named_enum(
-                        kv.key, "msgpack type name",
-                        MSGPACK_DECODE_CUSTOMIZE_TYPE_ENUM
-                    );
-                    JanetType decoded_type = (JanetType) parse_named_enum(
-                        kv.value, "Janet type name",
-                        JANET_TYPE_ENUM
-                    );
-                    if (msgpack_type == mpack_type_str) {
-                        switch (decoded_type) {
-                            case JANET_KEYWORD:
-                            case JANET_SYMBOL:
-                            case JANET_STRING:
-                            case JANET_BUFFER:
-                                decoder.string_type = decoded_type;
-                                break;
-                            default:
-                                janet_panicf(
-                                    "Invalid string type %T for msgpack type %s",
-                                    decoded_type,
-                                    mpack_type_to_string(msgpack_type)
-                                );
-                        }
-                        break; // breaks loop
-                    }
-                    #define HANDLE_CASE(msgpack_type_name, field_name, immutable_variant, mutable_variant) \
-                        case msgpack_type_name: { \
-                            assert(immutable_variant != mutable_variant); \
-                            switch (decoded_type) { \
-                                case mutable_variant: \
-                                    decoder.field_name = JANET_TYPE_MUTABLE; \
-                                    break; \
-                                case immutable_variant: \
-                                    decoder.field_name = JANET_TYPE_IMMUTABLE; \
-                                    break; \
-                                default: \
-                                    janet_panicf( \
-                                        "Expected either Janet type %s or %s for %s, but got %T", \
-                                        #immutable_variant, \
-                                        #mutable_variant, \
-                                        mpack_type_to_string(msgpack_type), \
-                                        decoded_type \
-                                    ); \
-                                    break; \
-                            } \
-                            break; \
-                        }
-                    switch (msgpack_type) {
-                        HANDLE_CASE(mpack_type_bin, bin_type, JANET_STRING, JANET_BUFFER)
-                        HANDLE_CASE(mpack_type_array, array_type, JANET_TUPLE, JANET_ARRAY)
-                        HANDLE_CASE(mpack_type_map, map_type, JANET_STRUCT, JANET_TABLE)
+    switch (janet_type(types)) {
+        case JANET_NIL:
+            return;
+        case JANET_TABLE:
+            jstruct = janet_table_to_struct(janet_unwrap_table(types));
+        case JANET_STRUCT: {
+            if (janet_type(types) == JANET_STRUCT) {
+                // Guard against the fallthrough ;)
+                assert(jstruct == NULL);
+                jstruct = janet_unwrap_struct(types);
+            }
+            assert(jstruct != NULL);
+            int32_t capacity = janet_struct_capacity(jstruct);
+            for (int32_t i = 0; i < capacity; i++) {
+                JanetKV kv = jstruct[i];
+                if (janet_checktype(kv.key, JANET_NIL)) continue;
+                mpack_type_t msgpack_type = (mpack_type_t) parse_named_enum(
+                    kv.key, "msgpack type name",
+                    MSGPACK_DECODE_CUSTOMIZE_TYPE_ENUM
+                );
+                JanetType decoded_type = (JanetType) parse_named_enum(
+                    kv.value, "Janet type name",
+                    JANET_TYPE_ENUM
+                );
+                if (msgpack_type == mpack_type_str) {
+                    switch (decoded_type) {
+                        case JANET_KEYWORD:
+                        case JANET_SYMBOL:
+                        case JANET_STRING:
+                        case JANET_BUFFER:
+                            decoder->string_type = decoded_type;
+                            break;
                         default:
                             janet_panicf(
-                                "Unable to customize Janet type corresponding to msgpack type %s",
+                                "Invalid string type %T for msgpack type %s",
+                                decoded_type,
                                 mpack_type_to_string(msgpack_type)
                             );
                     }
-                    #undef HANDLE_CASE
+                    continue;
                 }
-                break;
+                #define HANDLE_CASE(msgpack_type_name, field_name, immutable_variant, mutable_variant) \
+                    case msgpack_type_name: { \
+                        assert(immutable_variant != mutable_variant); \
+                        switch (decoded_type) { \
+                            case mutable_variant: \
+                                decoder->field_name = JANET_TYPE_MUTABLE; \
+                                break; \
+                            case immutable_variant: \
+                                decoder->field_name = JANET_TYPE_IMMUTABLE; \
+                                break; \
+                            default: \
+                                janet_panicf( \
+                                    "Expected either Janet type %s or %s for %s, but got %T", \
+                                    #immutable_variant, \
+                                    #mutable_variant, \
+                                    mpack_type_to_string(msgpack_type), \
+                                    decoded_type \
+                                ); \
+                                break; \
+                        } \
+                        break; \
+                    }
+                switch (msgpack_type) {
+                    HANDLE_CASE(mpack_type_bin, bin_type, JANET_STRING, JANET_BUFFER)
+                    HANDLE_CASE(mpack_type_array, array_type, JANET_TUPLE, JANET_ARRAY)
+                    HANDLE_CASE(mpack_type_map, map_type, JANET_STRUCT, JANET_TABLE)
+                    default:
+                        janet_panicf(
+                            "Unable to customize Janet type corresponding to msgpack type %s",
+                            mpack_type_to_string(msgpack_type)
+                        );
+                }
+                #undef HANDLE_CASE
             }
-            default:
-                janet_panicf("Expected either a table or struct, but got %t", argv[1]);
-                break;
+            break;
         }
+        default:
+            janet_panicf("Expected either a table or struct, but got %t", types);
+            break;
     }
-    return decode_msgpack(&decoder, 0);
+}
+/**
+ * Lookup a keyword option in an (optional) options table/struct
+ */
+static Janet get_option(Janet options, const char *name) {
+    if (janet_checktype(options, JANET_NIL)) return janet_wrap_nil();
+    return janet_get(options, janet_ckeywordv(name));
+}
+static int64_t get_limit_option(Janet options, const char *name, int64_t dflt) {
+    Janet value = get_option(options, name);
+    if (janet_checktype(value, JANET_NIL)) return dflt;
+    if (!janet_checkint64(value) || janet_unwrap_number(value) < 0) {
+        janet_panicf("Expected a non-negative integer for :%s, but got %v", name, value);
+    }
+    return (int64_t) janet_unwrap_number(value);
+}
+static int8_t get_ext_type_option(Janet options, const char *name, int8_t dflt) {
+    Janet value = get_option(options, name);
+    if (janet_checktype(value, JANET_NIL)) return dflt;
+    if (!janet_checkint(value) || janet_unwrap_integer(value) < INT8_MIN || janet_unwrap_integer(value) > INT8_MAX) {
+        janet_panicf("Expected an ext type between -128 and 127 for :%s, but got %v", name, value);
+    }
+    return (int8_t) janet_unwrap_integer(value);
+}
+/**
+ * Add a key, or a path of keys, to an :only projection.
+ *
+ * The projection maps each wanted key to true (the whole value) or to
+ * another projection of the keys wanted inside it.
+ */
+static void add_projection(JanetTable *only, Janet path) {
+    const Janet *keys;
+    int32_t len;
+    if (!janet_indexed_view(path, &keys, &len)) {
+        keys = &path;
+        len = 1;
+    }
+    if (len == 0) janet_panic("Expected a non-empty path of keys");
+    for (int32_t i = 0; i < len; i++) {
+        Janet key = normalize_map_key(keys[i]);
+        Janet existing = janet_table_get(only, key);
+        // Already decoding the whole value
+        if (janet_checktype(existing, JANET_BOOLEAN)) return;
+        if (i == len - 1) {
+            janet_table_put(only, key, janet_wrap_true());
+        } else if (janet_checktype(existing, JANET_TABLE)) {
+            only = janet_unwrap_table(existing);
+        } else {
+            JanetTable *inner = janet_table(4);
+            janet_table_put(only, key, janet_wrap_table(inner));
+            only = inner;
+        }
+    }
+}
+/**
+ * Parse the `options` argument of decode, shared by all the decoding entry points.
+ */
+static void parse_decode_options(struct janet_msgpack_decoder *decoder, Janet options) {
+    switch (janet_type(options)) {
+        case JANET_NIL:
+        case JANET_TABLE:
+        case JANET_STRUCT:
+            break;
+        default:
+            janet_panicf("Expected decode options to be a table or struct, but got %t", options);
+    }
+    decoder->limits.max_elements = get_limit_option(options, "max-elements", -1);
+    decoder->limits.max_bytes = get_limit_option(options, "max-bytes", -1);
+    decoder->limits.max_string = get_limit_option(options, "max-string", -1);
+    int64_t max_depth = get_limit_option(options, "max-depth", JANET_RECURSION_GUARD);
+    decoder->limits.max_depth = (int32_t) (max_depth > JANET_RECURSION_GUARD ? JANET_RECURSION_GUARD : max_depth);
+    Janet registry = get_option(options, "ext");
+    if (!janet_checktype(registry, JANET_NIL)) {
+        decoder->registry = janet_getabstract(&registry, 0, &msgpack_ext_registry_type);
+    }
+    Janet dictionary = get_option(options, "dictionary");
+    if (!janet_checktype(dictionary, JANET_NIL)) {
+        decoder->dictionary = janet_getabstract(&dictionary, 0, &msgpack_dictionary_type);
+    }
+    Janet raw_keys = get_option(options, "raw");
+    if (!janet_checktype(raw_keys, JANET_NIL)) {
+        const Janet *keys;
+        int32_t count;
+        if (!janet_indexed_view(raw_keys, &keys, &count)) {
+            janet_panicf("Expected :raw to be an array or tuple of keys & paths, but got %t", raw_keys);
+        }
+        for (int32_t i = 0; i < count; i++) {
+            if (janet_checktypes(keys[i], JANET_TFLAG_INDEXED)) {
+                if (decoder->raw_paths == NULL) decoder->raw_paths = janet_table(count);
+                add_projection(decoder->raw_paths, keys[i]);
+            } else {
+                if (decoder->raw_keys == NULL) decoder->raw_keys = janet_table(count);
+                janet_table_put(decoder->raw_keys, normalize_map_key(keys[i]), janet_wrap_true());
+            }
+        }
+    }
+    Janet only = get_option(options, "only");
+    if (!janet_checktype(only, JANET_NIL)) {
+        const Janet *paths;
+        int32_t count;
+        if (!janet_indexed_view(only, &paths, &count)) {
+            janet_panicf("Expected :only to be an array or tuple of keys & paths, but got %t", only);
+        }
+        decoder->only = janet_table(count);
+        for (int32_t i = 0; i < count; i++) add_projection(decoder->only, paths[i]);
+    }
+    Janet timestamp_type = get_option(options, "timestamp");
+    if (!janet_checktype(timestamp_type, JANET_NIL)) {
+        decoder->timestamp_type = (enum msgpack_timestamp_type) parse_named_enum(
+            timestamp_type, "timestamp type ('number or 'abstract)",
+            MSGPACK_TIMESTAMP_TYPE_ENUM
+        );
+    }
+    Janet columnar = get_option(options, "columnar");
+    if (janet_checktype(columnar, JANET_BOOLEAN)) {
+        decoder->columnar = janet_truthy(columnar) ? MSGPACK_COLUMNAR_ROWS : MSGPACK_COLUMNAR_OFF;
+    } else if (!janet_checktype(columnar, JANET_NIL)) {
+        decoder->columnar = (enum msgpack_columnar_mode) parse_named_enum(
+            columnar, "columnar mode ('rows or 'columns)",
+            MSGPACK_COLUMNAR_MODE_ENUM
+        );
+    }
+    decoder->columnar_ext = get_ext_type_option(options, "columnar-ext", MSGPACK_EXT_COLUMNS);
+    decoder->dedupe = janet_truthy(get_option(options, "dedupe"));
+    decoder->dedupe_ext = get_ext_type_option(options, "dedupe-ext", MSGPACK_EXT_BACKREF);
+    decoder->shared = janet_truthy(get_option(options, "shared"));
+    decoder->shared_ext = get_ext_type_option(options, "shared-ext", MSGPACK_EXT_SHARED);
+    if (decoder->shared) decoder->shared_values = janet_table(0);
+    // A shared container is decoded once, but each reference to it may project different keys
+    if (decoder->shared && decoder->only != NULL) janet_panic(":shared can't be combined with :only");
+}
+/**
+ * Report the decoder's running totals into the :stats table, if one was given.
+ */
+static void report_decode_stats(struct janet_msgpack_decoder *decoder, Janet options) {
+    Janet stats = get_option(options, "stats");
+    if (janet_checktype(stats, JANET_NIL)) return;
+    if (!janet_checktype(stats, JANET_TABLE)) {
+        janet_panicf("Expected :stats to be a table, but got %t", stats);
+    }
+    JanetTable *table = janet_unwrap_table(stats);
+    janet_table_put(table, janet_ckeywordv("elements"), janet_wrap_number((double) decoder->stats.elements));
+    janet_table_put(table, janet_ckeywordv("bytes"), janet_wrap_number((double) decoder->stats.bytes));
+    janet_table_put(table, janet_ckeywordv("depth"), janet_wrap_integer(decoder->stats.depth));
+}
+/**
+ * Decode the first object in data, as configured by the (optional) decoded-types & options.
+ */
+static Janet decode_msgpack_data(const uint8_t *data, size_t len, Janet types, Janet options) {
+    mpack_reader_t reader;
+    mpack_reader_init_data(&reader, (const char*) data, len);
+    mpack_reader_set_error_handler(&reader, janet_msgpack_error_handler);
+    struct janet_msgpack_decoder decoder = {
+        .reader = &reader,
+        .message = data,
+        .message_len = len,
+        .string_type = JANET_STRING,
+        .bin_type = JANET_TYPE_MUTABLE,
+        .array_type = JANET_TYPE_MUTABLE,
+        .map_type = JANET_TYPE_MUTABLE
+    };
+    parse_decoded_types(&decoder, types);
+    parse_decode_options(&decoder, options);
+    Janet result = decode_msgpack(&decoder, 0);
+    report_decode_stats(&decoder, options);
+    return result;
+}
+static Janet janet_msgpack_decode(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 3);
+    const uint8_t *data;
+    size_t len;
+    msgpack_bytes_view(argv[0], &data, &len);
+    return decode_msgpack_data(
+        data, len,
+        argc > 1 ? argv[1] : janet_wrap_nil(),
+        argc > 2 ? argv[2] : janet_wrap_nil()
+    );
+}
+static Janet janet_msgpack_dictionary(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 2);
+    const Janet *entries;
+    int32_t count;
+    if (!janet_indexed_view(argv[0], &entries, &count)) {
+        // Previously saved with (msgpack/encode (get dictionary :entries))
+        const uint8_t *data;
+        size_t len;
+        msgpack_bytes_view(argv[0], &data, &len);
+        Janet decoded = decode_msgpack_data(data, len, janet_wrap_nil(), janet_wrap_nil());
+        if (!janet_indexed_view(decoded, &entries, &count)) {
+            janet_panicf("Expected an encoded array of dictionary entries, but got %t", decoded);
+        }
+    }
+    if (count > MSGPACK_DICTIONARY_MAX) {
+        janet_panicf("Dictionaries are limited to %d entries, but got %d", MSGPACK_DICTIONARY_MAX, count);
+    }
+    int8_t exttype = MSGPACK_EXT_DICTIONARY;
+    if (argc > 1) {
+        int32_t value = janet_getinteger(argv, 1);
+        if (value < INT8_MIN || value > INT8_MAX) janet_panicf("Expected an ext type between -128 and 127, but got %d", value);
+        exttype = (int8_t) value;
+    }
+    struct msgpack_dictionary *dictionary = janet_abstract(&msgpack_dictionary_type, sizeof(struct msgpack_dictionary));
+    dictionary->exttype = exttype;
+    dictionary->index = janet_table(count * 3);
+    Janet *strings = janet_tuple_begin(count);
+    Janet *keywords = janet_tuple_begin(count);
+    for (int32_t i = 0; i < count; i++) {
+        if (!janet_checktypes(entries[i], JANET_TFLAG_STRING | JANET_TFLAG_KEYWORD | JANET_TFLAG_SYMBOL)) {
+            janet_panicf("Expected dictionary entries to be strings, keywords or symbols, but got %v", entries[i]);
+        }
+        const uint8_t *bytes;
+        int32_t len;
+        janet_bytes_view(entries[i], &bytes, &len);
+        strings[i] = janet_stringv(bytes, len);
+        keywords[i] = janet_keywordv(bytes, len);
+        if (!janet_checktype(janet_table_get(dictionary->index, strings[i]), JANET_NIL)) {
+            janet_panicf("Duplicate dictionary entry %v", strings[i]);
+        }
+        janet_table_put(dictionary->index, strings[i], janet_wrap_integer(i));
+        janet_table_put(dictionary->index, keywords[i], janet_wrap_integer(i));
+        janet_table_put(dictionary->index, janet_symbolv(bytes, len), janet_wrap_integer(i));
+    }
+    dictionary->strings = janet_tuple_end(strings);
+    dictionary->keywords = janet_tuple_end(keywords);
+    return janet_wrap_abstract(dictionary);
+}
+/************/
+/* Scanning */
+/************/
+
+/*
+ * A small hand-written parser over the raw bytes, used wherever we only need
+ * the structure of a message and not its values. It never allocates.
+ */
+
+#define MSGPACK_SCAN_MAX_DEPTH JANET_RECURSION_GUARD
+
+struct msgpack_header {
+    mpack_type_t type;
+    int8_t exttype;
+    uint8_t header_len;
+    // Element count for arrays, entry count for maps
+    uint32_t count;
+    // Bytes following the header (zero for arrays & maps)
+    uint32_t payload;
+};
+
+/**
+ * Parse the header of the object starting at data[pos].
+ *
+ * Returns false if the header is truncated or uses the reserved byte 0xC1.
+ * This does not check that the payload actually fits in the input.
+ */
+static bool read_msgpack_header(const uint8_t *data, size_t len, size_t pos, struct msgpack_header *header) {
+    if (pos >= len) return false;
+    uint8_t b = data[pos];
+    size_t available = len - pos - 1;
+    header->exttype = 0;
+    header->count = 0;
+    header->payload = 0;
+    header->header_len = 1;
+    if (b <= 0x7F) {
+        header->type = mpack_type_uint;
+        return true;
+    } else if (b <= 0x8F) {
+        header->type = mpack_type_map;
+        header->count = b & 0x0F;
+        return true;
+    } else if (b <= 0x9F) {
+        header->type = mpack_type_array;
+        header->count = b & 0x0F;
+        return true;
+    } else if (b <= 0xBF) {
+        header->type = mpack_type_str;
+        header->payload = b & 0x1F;
+        return true;
+    } else if (b >= 0xE0) {
+        header->type = mpack_type_int;
+        return true;
+    }
+    uint8_t len_bytes = 0;
+    switch (b) {
+        case 0xC0:
+            header->type = mpack_type_nil;
+            return true;
+        case 0xC2:
+        case 0xC3:
+            header->type = mpack_type_bool;
+            return true;
+        case 0xC4: case 0xC5: case 0xC6:
+            header->type = mpack_type_bin;
+            len_bytes = 1 << (b - 0xC4);
+            break;
+        case 0xC7: case 0xC8: case 0xC9:
+            header->type = mpack_type_ext;
+            len_bytes = 1 << (b - 0xC7);
+            break;
+        case 0xCA:
+            header->type = mpack_type_float;
+            header->payload = 4;
+            return true;
+        case 0xCB:
+            header->type = mpack_type_double;
+            header->payload = 8;
+            return true;
+        case 0xCC: case 0xCD: case 0xCE: case 0xCF:
+            header->type = mpack_type_uint;
+            header->payload = 1 << (b - 0xCC);
+            return true;
+        case 0xD0: case 0xD1: case 0xD2: case 0xD3:
+            header->type = mpack_type_int;
+            header->payload = 1 << (b - 0xD0);
+            return true;
+        case 0xD4: case 0xD5: case 0xD6: case 0xD7: case 0xD8:
+            if (available < 1) return false;
+            header->type = mpack_type_ext;
+            header->exttype = (int8_t) data[pos + 1];
+            header->header_len = 2;
+            header->payload = 1 << (b - 0xD4);
+            return true;
+        case 0xD9: case 0xDA: case 0xDB:
+            header->type = mpack_type_str;
+            len_bytes = 1 << (b - 0xD9);
+            break;
+        case 0xDC: case 0xDD:
+            header->type = mpack_type_array;
+            len_bytes = 2 << (b - 0xDC);
+            break;
+        case 0xDE: case 0xDF:
+            header->type = mpack_type_map;
+            len_bytes = 2 << (b - 0xDE);
+            break;
+        default:
+            // 0xC1 is never used
+            return false;
+    }
+    uint8_t extra = header->type == mpack_type_ext ? 1 : 0;
+    if (available < (size_t) (len_bytes + extra)) return false;
+    uint32_t value = (uint32_t) read_bigendian(data + pos + 1, len_bytes);
+    header->header_len = 1 + len_bytes + extra;
+    if (header->type == mpack_type_array || header->type == mpack_type_map) {
+        header->count = value;
+    } else {
+        header->payload = value;
+    }
+    if (extra) header->exttype = (int8_t) data[pos + 1 + len_bytes];
+    return true;
+}
+
+/**
+ * Check the bytes are valid UTF-8, rejecting overlong forms and surrogates.
+ */
+static bool msgpack_utf8_valid(const uint8_t *data, size_t len) {
+    size_t i = 0;
+    while (i < len) {
+        // ASCII fast path, eight bytes at a time
+        if (len - i >= 8) {
+            uint64_t chunk;
+            memcpy(&chunk, data + i, 8);
+            if ((chunk & UINT64_C(0x8080808080808080)) == 0) {
+                i += 8;
+                continue;
+            }
+        }
+        uint8_t c = data[i];
+        if (c < 0x80) {
+            i += 1;
+            continue;
+        }
+        size_t extra;
+        uint32_t codepoint;
+        if (c >= 0xC2 && c <= 0xDF) {
+            extra = 1;
+            codepoint = c & 0x1F;
+        } else if ((c & 0xF0) == 0xE0) {
+            extra = 2;
+            codepoint = c & 0x0F;
+        } else if (c >= 0xF0 && c <= 0xF4) {
+            extra = 3;
+            codepoint = c & 0x07;
+        } else {
+            return false;
+        }
+        if (len - i <= extra) return false;
+        for (size_t j = 1; j <= extra; j++) {
+            uint8_t continuation = data[i + j];
+            if ((continuation & 0xC0) != 0x80) return false;
+            codepoint = (codepoint << 6) | (continuation & 0x3F);
+        }
+        if (extra == 2 && (codepoint < 0x800 || (codepoint >= 0xD800 && codepoint <= 0xDFFF))) return false;
+        if (extra == 3 && (codepoint < 0x10000 || codepoint > 0x10FFFF)) return false;
+        i += extra + 1;
+    }
+    return true;
+}
+
+union msgpack_scalar {
+    bool b;
+    int64_t i;
+    uint64_t u;
+    double d;
+};
+/**
+ * Read the value of a bool/int/uint/float/double, given the header at `start`.
+ *
+ * Floats are widened to doubles.
+ */
+static void read_msgpack_scalar(const uint8_t *start, const struct msgpack_header *header, union msgpack_scalar *value) {
+    const uint8_t *payload = start + header->header_len;
+    uint64_t bits = read_bigendian(payload, (uint8_t) header->payload);
+    switch (header->type) {
+        case mpack_type_bool:
+            value->b = start[0] == 0xC3;
+            break;
+        case mpack_type_uint:
+            value->u = header->payload == 0 ? start[0] : bits;
+            break;
+        case mpack_type_int:
+            switch (header->payload) {
+                case 0: value->i = (int8_t) start[0]; break;
+                case 1: value->i = (int8_t) bits; break;
+                case 2: value->i = (int16_t) bits; break;
+                case 4: value->i = (int32_t) bits; break;
+                default: value->i = (int64_t) bits; break;
+            }
+            break;
+        case mpack_type_float: {
+            uint32_t narrow = (uint32_t) bits;
+            float f;
+            memcpy(&f, &narrow, sizeof(f));
+            value->d = f;
+            break;
+        }
+        case mpack_type_double:
+            memcpy(&value->d, &bits, sizeof(value->d));
+            break;
+        default:
+            value->u = 0;
+            break;
+    }
+}
+
+struct msgpack_scan_result {
+    // Offset just past the scanned object
+    size_t end;
+    // Array items & map entries, counted the same way as the decoder's :stats
+    int64_t elements;
+    int32_t depth;
+};
+
+/**
+ * Find the extent of the single object starting at data[pos], validating it.
+ *
+ * Returns NULL on success, or a static error message.
+ */
+static const char *scan_msgpack(const uint8_t *data, size_t len, size_t pos, bool check_utf8, int32_t max_depth, struct msgpack_scan_result *result) {
+    // Items remaining at each level of nesting
+    uint64_t remaining[MSGPACK_SCAN_MAX_DEPTH + 1];
+    int32_t depth = 0;
+    if (max_depth > MSGPACK_SCAN_MAX_DEPTH) max_depth = MSGPACK_SCAN_MAX_DEPTH;
+    remaining[0] = 1;
+    result->elements = 0;
+    result->depth = 0;
+    while (true) {
+        while (remaining[depth] == 0) {
+            if (depth == 0) {
+                result->end = pos;
+                return NULL;
+            }
+            depth -= 1;
+        }
+        remaining[depth] -= 1;
+        if (depth > result->depth) result->depth = depth;
+        struct msgpack_header header;
+        if (!read_msgpack_header(data, len, pos, &header)) {
+            return pos >= len ? "unexpected end of msgpack input" : "invalid msgpack type byte";
+        }
+        pos += header.header_len;
+        switch (header.type) {
+            case mpack_type_array:
+            case mpack_type_map: {
+                if (header.count == 0) break;
+                // Every element needs at least one byte
+                uint64_t items = header.type == mpack_type_map ? 2 * (uint64_t) header.count : header.count;
+                if (items > len - pos) return "msgpack container is longer than the input";
+                if (depth >= max_depth) return "msgpack nested too deeply";
+                result->elements += header.count;
+                depth += 1;
+                remaining[depth] = items;
+                break;
+            }
+            default:
+                if (header.payload > len - pos) return "unexpected end of msgpack input";
+                if (check_utf8 && header.type == mpack_type_str && !msgpack_utf8_valid(data + pos, header.payload)) {
+                    return "invalid UTF-8 in msgpack string";
+                }
+                pos += header.payload;
+                break;
+        }
+    }
+}
+
+static Janet janet_msgpack_scan(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 2);
+    const uint8_t *data;
+    size_t len;
+    msgpack_bytes_view(argv[0], &data, &len);
+    Janet options = argc > 1 ? argv[1] : janet_wrap_nil();
+    int64_t start = get_limit_option(options, "start", 0);
+    int64_t max_depth = get_limit_option(options, "max-depth", MSGPACK_SCAN_MAX_DEPTH);
+    bool check_utf8 = janet_truthy(get_option(options, "utf8"));
+    bool single = janet_truthy(get_option(options, "single"));
+    if ((uint64_t) start > len) janet_panicf("Start offset %d is past the end of the input", (int32_t) start);
+    struct msgpack_scan_result result;
+    const char *error = scan_msgpack(data, len, (size_t) start, check_utf8, (int32_t) max_depth, &result);
+    if (error != NULL) janet_panicf("Error scanning msgpack: %s", error);
+    if (single && result.end != len) {
+        janet_panicf("Found %d trailing bytes after msgpack object", (int32_t) (len - result.end));
+    }
+    JanetKV *st = janet_struct_begin(3);
+    janet_struct_put(st, janet_ckeywordv("end"), janet_wrap_number((double) result.end));
+    janet_struct_put(st, janet_ckeywordv("elements"), janet_wrap_number((double) result.elements));
+    janet_struct_put(st, janet_ckeywordv("depth"), janet_wrap_integer(result.depth));
+    return janet_wrap_struct(janet_struct_end(st));
+}
+
+static Janet janet_msgpack_valid(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 2);
+    const uint8_t *data;
+    size_t len;
+    msgpack_bytes_view(argv[0], &data, &len);
+    Janet options = argc > 1 ? argv[1] : janet_wrap_nil();
+    Janet single_option = get_option(options, "single");
+    bool single = janet_checktype(single_option, JANET_NIL) || janet_truthy(single_option);
+    bool check_utf8 = janet_truthy(get_option(options, "utf8"));
+    int64_t max_depth = get_limit_option(options, "max-depth", MSGPACK_SCAN_MAX_DEPTH);
+    size_t pos = 0;
+    do {
+        struct msgpack_scan_result result;
+        if (scan_msgpack(data, len, pos, check_utf8, (int32_t) max_depth, &result) != NULL) {
+            return janet_wrap_false();
+        }
+        pos = result.end;
+    } while (!single && pos < len);
+    return janet_wrap_boolean(pos == len);
+}
+
+static Janet janet_msgpack_raw(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 2);
+    const uint8_t *data;
+    size_t len;
+    msgpack_bytes_view(argv[0], &data, &len);
+    if (argc < 2 || janet_truthy(argv[1])) {
+        struct msgpack_scan_result result;
+        const char *error = scan_msgpack(data, len, 0, false, MSGPACK_SCAN_MAX_DEPTH, &result);
+        if (error != NULL) janet_panicf("Invalid raw msgpack: %s", error);
+        if (result.end != len) janet_panic("Invalid raw msgpack: expected exactly one object");
+    }
+    if (janet_checktype(argv[0], JANET_STRING)) {
+        struct msgpack_raw *raw = janet_abstract(&msgpack_raw_type, sizeof(struct msgpack_raw));
+        raw->bytes = argv[0];
+        return janet_wrap_abstract(raw);
+    }
+    return wrap_raw(data, len);
+}
+
+/***********/
+/* Editing */
+/***********/
+
+/*
+ * Edits of an encoded message, without decoding it.
+ *
+ * We follow a path of map keys & array indices by skipping over sibling
+ * extents, then splice the new value in. Only the innermost container's
+ * header can change (its count), since msgpack containers don't record their
+ * size in bytes. Everything else is copied through untouched.
+ */
+
+struct msgpack_edit_target {
+    // The innermost container, whose header may need rewriting
+    size_t header_pos;
+    struct msgpack_header header;
+    // Start of the map key (same as start for arrays)
+    size_t key_start;
+    // Extent of the value, or the insertion point if it was not found
+    size_t start;
+    size_t end;
+    bool found;
+};
+
+static size_t skip_msgpack(const uint8_t *data, size_t len, size_t pos) {
+    struct msgpack_scan_result result;
+    const char *error = scan_msgpack(data, len, pos, false, MSGPACK_SCAN_MAX_DEPTH, &result);
+    if (error != NULL) janet_panicf("Error scanning msgpack: %s", error);
+    return result.end;
+}
+
+/**
+ * Check whether the map key at data[pos] is equal to a Janet key.
+ */
+static bool msgpack_key_matches(const uint8_t *data, const struct msgpack_header *header, Janet key) {
+    const uint8_t *bytes;
+    int32_t bytes_len;
+    if (janet_checktype(key, JANET_NUMBER)) {
+        union msgpack_scalar value;
+        double n = janet_unwrap_number(key);
+        switch (header->type) {
+            case mpack_type_int:
+                read_msgpack_scalar(data, header, &value);
+                return (double) value.i == n;
+            case mpack_type_uint:
+                read_msgpack_scalar(data, header, &value);
+                return (double) value.u == n;
+            case mpack_type_float:
+            case mpack_type_double:
+                read_msgpack_scalar(data, header, &value);
+                return value.d == n;
+            default:
+                return false;
+        }
+    } else if (janet_bytes_view(key, &bytes, &bytes_len)) {
+        return (header->type == mpack_type_str || header->type == mpack_type_bin) &&
+            header->payload == (uint32_t) bytes_len &&
+            memcmp(data + header->header_len, bytes, bytes_len) == 0;
+    }
+    janet_panicf("Expected a string, keyword or number key, but got %t", key);
+}
+
+/**
+ * Follow a path of keys/indices through the object at the start of data.
+ *
+ * Every container along the path must exist, but the final key may be missing.
+ */
+static void locate_msgpack_path(const uint8_t *data, size_t len, const Janet *path, int32_t path_len, struct msgpack_edit_target *target) {
+    if (path_len == 0) janet_panic("Expected a non-empty path");
+    size_t pos = 0;
+    for (int32_t i = 0; i < path_len; i++) {
+        bool last = i == path_len - 1;
+        struct msgpack_header header;
+        if (!read_msgpack_header(data, len, pos, &header)) janet_panic("Error scanning msgpack: invalid header");
+        if (header.type != mpack_type_array && header.type != mpack_type_map) {
+            janet_panicf("Expected a map or array at path element %d", i);
+        }
+        target->header_pos = pos;
+        target->header = header;
+        target->found = false;
+        size_t child = pos + header.header_len;
+        if (header.type == mpack_type_array) {
+            if (!janet_checkint(path[i]) || janet_unwrap_integer(path[i]) < 0) {
+                janet_panicf("Expected a non-negative array index at path element %d, but got %v", i, path[i]);
+            }
+            uint32_t index = (uint32_t) janet_unwrap_integer(path[i]);
+            if (index > header.count || (index == header.count && !last)) {
+                janet_panicf("Array index %d is out of range at path element %d", (int32_t) index, i);
+            }
+            for (uint32_t j = 0; j < index; j++) child = skip_msgpack(data, len, child);
+            target->key_start = child;
+            target->start = child;
+            if (index < header.count) {
+                target->found = true;
+                target->end = skip_msgpack(data, len, child);
+            }
+        } else {
+            for (uint32_t j = 0; j < header.count; j++) {
+                struct msgpack_header key_header;
+                size_t value = skip_msgpack(data, len, child);
+                read_msgpack_header(data, len, child, &key_header);
+                size_t next = skip_msgpack(data, len, value);
+                if (msgpack_key_matches(data + child, &key_header, path[i])) {
+                    target->found = true;
+                    target->key_start = child;
+                    target->start = value;
+                    target->end = next;
+                    break;
+                }
+                child = next;
+            }
+            if (!target->found) {
+                if (!last) janet_panicf("Key %v not found at path element %d", path[i], i);
+                target->key_start = child;
+                target->start = child;
+            }
+        }
+        pos = target->start;
+    }
+}
+
+/**
+ * Write data to a buffer with the located value replaced by `value`, or removed.
+ *
+ * Missing keys are inserted at the end of their map (or array, for an index
+ * just past the end).
+ */
+static void splice_msgpack(JanetBuffer *buffer, const uint8_t *data, size_t len, const struct msgpack_edit_target *target, Janet key, const Janet *value) {
+    const struct msgpack_header *header = &target->header;
+    bool is_map = header->type == mpack_type_map;
+    int64_t count = header->count;
+    if (value == NULL && !target->found) {
+        janet_buffer_push_bytes(buffer, data, (int32_t) len);
+        return;
+    }
+    if (value == NULL) count -= 1;
+    else if (!target->found) count += 1;
+    if (count > INT32_MAX) janet_panic("Container is too large to edit");
+    struct msgpack_encoder encoder = {
+        .buffer = buffer,
+        .string_type = MSGPACK_STRING_STRING,
+        .buffer_type = MSGPACK_BYTES_STRING,
+    };
+    janet_buffer_push_bytes(buffer, data, (int32_t) target->header_pos);
+    encode_msgpack_collection_length(&encoder, (int32_t) count, is_map ? 0x80 : 0x90, is_map ? 0xDE : 0xDC);
+    size_t body = target->header_pos + header->header_len;
+    if (value == NULL) {
+        janet_buffer_push_bytes(buffer, data + body, (int32_t) (target->key_start - body));
+    } else {
+        janet_buffer_push_bytes(buffer, data + body, (int32_t) (target->start - body));
+        if (!target->found && is_map) encode_msgpack(&encoder, key, 0);
+        encode_msgpack(&encoder, *value, 0);
+    }
+    size_t rest = target->found ? target->end : target->start;
+    janet_buffer_push_bytes(buffer, data + rest, (int32_t) (len - rest));
+}
+
+static void check_edit_length(size_t len) {
+    if (len > INT32_MAX) janet_panic("Input is too large to edit");
+}
+
+static Janet edit_msgpack(Janet bytes, const Janet *path, int32_t path_len, const Janet *value) {
+    const uint8_t *data;
+    size_t len;
+    msgpack_bytes_view(bytes, &data, &len);
+    check_edit_length(len);
+    struct msgpack_edit_target target;
+    locate_msgpack_path(data, len, path, path_len, &target);
+    // As with tables, associating nil removes a map key
+    if (value != NULL && janet_checktype(*value, JANET_NIL) && target.header.type == mpack_type_map) value = NULL;
+    JanetBuffer *buffer = janet_buffer((int32_t) len + 16);
+    splice_msgpack(buffer, data, len, &target, path[path_len - 1], value);
+    return janet_wrap_buffer(buffer);
+}
+
+static Janet janet_msgpack_assoc(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 3);
+    return edit_msgpack(argv[0], &argv[1], 1, &argv[2]);
+}
+
+static Janet janet_msgpack_dissoc(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    return edit_msgpack(argv[0], &argv[1], 1, NULL);
+}
+
+static Janet janet_msgpack_update_in(int32_t argc, Janet *argv) {
+    janet_arity(argc, 3, -1);
+    const Janet *path;
+    int32_t path_len;
+    if (!janet_indexed_view(argv[1], &path, &path_len)) {
+        janet_panicf("Expected an array or tuple path, but got %t", argv[1]);
+    }
+    const uint8_t *data;
+    size_t len;
+    msgpack_bytes_view(argv[0], &data, &len);
+    struct msgpack_edit_target target;
+    locate_msgpack_path(data, len, path, path_len, &target);
+    // The callback gets the old value followed by any extra arguments
+    int32_t nargs = argc - 2;
+    Janet *args = janet_smalloc(sizeof(Janet) * nargs);
+    args[0] = target.found
+        ? decode_msgpack_data(data + target.start, target.end - target.start, janet_wrap_nil(), janet_wrap_nil())
+        : janet_wrap_nil();
+    for (int32_t i = 3; i < argc; i++) args[i - 2] = argv[i];
+    Janet value;
+    if (janet_checktype(argv[2], JANET_CFUNCTION)) {
+        value = janet_unwrap_cfunction(argv[2])(nargs, args);
+    } else {
+        JanetSignal signal = janet_pcall(janet_getfunction(argv, 2), nargs, args, &value, NULL);
+        if (signal != JANET_SIGNAL_OK) {
+            janet_sfree(args);
+            janet_panicv(value);
+        }
+    }
+    janet_sfree(args);
+    // The callback may have modified a buffer we were given
+    return edit_msgpack(argv[0], path, path_len, &value);
+}
+
+/**********/
+/* Select */
+/**********/
+
+/*
+ * Filtering and aggregating a stream of concatenated records on the encoded
+ * bytes. Fields are found by skipping over sibling extents, and only the
+ * matching records (or the aggregates) are turned into Janet values.
+ */
+
+enum msgpack_select_op {
+    MSGPACK_SELECT_EQ,
+    MSGPACK_SELECT_NE,
+    MSGPACK_SELECT_LT,
+    MSGPACK_SELECT_LE,
+    MSGPACK_SELECT_GT,
+    MSGPACK_SELECT_GE,
+    MSGPACK_SELECT_HAS
+};
+static const struct enum_entry MSGPACK_SELECT_OP_ENUM[] = {
+    {"=", MSGPACK_SELECT_EQ},
+    {"not=", MSGPACK_SELECT_NE},
+    {"<", MSGPACK_SELECT_LT},
+    {"<=", MSGPACK_SELECT_LE},
+    {">", MSGPACK_SELECT_GT},
+    {">=", MSGPACK_SELECT_GE},
+    {"has", MSGPACK_SELECT_HAS},
+    {NULL, 0}
+};
+
+/*
+ * A field is a single key, or a path of keys (and array indices) viewed
+ * from a tuple/array in the query.
+ */
+struct msgpack_field {
+    Janet key;
+    // NULL for a single key
+    const Janet *path;
+    int32_t len;
+};
+
+struct msgpack_predicate {
+    enum msgpack_select_op op;
+    struct msgpack_field field;
+    Janet constant;
+};
+
+struct msgpack_aggregate {
+    int64_t count;
+    double sum;
+    double min;
+    double max;
+    // Number of records that had a numeric value for the min/max field
+    int64_t min_count;
+    int64_t max_count;
+};
+
+static void parse_msgpack_field(Janet value, struct msgpack_field *field) {
+    field->key = value;
+    if (janet_indexed_view(value, &field->path, &field->len)) {
+        if (field->len == 0) janet_panic("Expected a non-empty field path");
+    } else {
+        field->path = NULL;
+        field->len = 1;
+    }
+    for (int32_t i = 0; i < field->len; i++) {
+        Janet key = field->path == NULL ? value : field->path[i];
+        if (!janet_checktype(key, JANET_NUMBER) && !janet_checktype(key, JANET_KEYWORD) &&
+                !janet_checktype(key, JANET_STRING) && !janet_checktype(key, JANET_SYMBOL)) {
+            janet_panicf("Expected a field key or path, but got %v", value);
+        }
+    }
+}
+
+/**
+ * Find the value of a field within the record at data[pos], without panicking if it's missing.
+ */
+static bool find_msgpack_field(const uint8_t *data, size_t len, size_t pos, const struct msgpack_field *field, size_t *out) {
+    const Janet *path = field->path != NULL ? field->path : &field->key;
+    for (int32_t i = 0; i < field->len; i++) {
+        Janet key = path[i];
+        struct msgpack_header header;
+        if (!read_msgpack_header(data, len, pos, &header)) return false;
+        size_t child = pos + header.header_len;
+        if (header.type == mpack_type_map) {
+            bool found = false;
+            for (uint32_t j = 0; j < header.count && !found; j++) {
+                struct msgpack_header key_header;
+                if (!read_msgpack_header(data, len, child, &key_header)) return false;
+                size_t value = skip_msgpack(data, len, child);
+                if (msgpack_key_matches(data + child, &key_header, key)) {
+                    pos = value;
+                    found = true;
+                } else {
+                    child = skip_msgpack(data, len, value);
+                }
+            }
+            if (!found) return false;
+        } else if (header.type == mpack_type_array && janet_checkint(key)) {
+            int32_t index = janet_unwrap_integer(key);
+            if (index < 0 || (uint32_t) index >= header.count) return false;
+            for (int32_t j = 0; j < index; j++) child = skip_msgpack(data, len, child);
+            pos = child;
+        } else {
+            return false;
+        }
+    }
+    *out = pos;
+    return true;
+}
+
+static bool read_msgpack_number(const uint8_t *data, size_t len, size_t pos, double *out) {
+    struct msgpack_header header;
+    union msgpack_scalar value;
+    if (!read_msgpack_header(data, len, pos, &header) || header.payload > len - pos - header.header_len) return false;
+    switch (header.type) {
+        case mpack_type_int:
+            read_msgpack_scalar(data + pos, &header, &value);
+            *out = (double) value.i;
+            return true;
+        case mpack_type_uint:
+            read_msgpack_scalar(data + pos, &header, &value);
+            *out = (double) value.u;
+            return true;
+        case mpack_type_float:
+        case mpack_type_double:
+            read_msgpack_scalar(data + pos, &header, &value);
+            *out = value.d;
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Compare the value at data[pos] with a constant, returning false if they aren't comparable.
+ */
+static bool compare_msgpack_constant(const uint8_t *data, size_t len, size_t pos, Janet constant, int *cmp) {
+    struct msgpack_header header;
+    if (!read_msgpack_header(data, len, pos, &header) || header.payload > len - pos - header.header_len) return false;
+    const uint8_t *bytes;
+    int32_t bytes_len;
+    if (janet_checktype(constant, JANET_NUMBER)) {
+        double value;
+        double n = janet_unwrap_number(constant);
+        if (!read_msgpack_number(data, len, pos, &value)) return false;
+        *cmp = value < n ? -1 : (value > n ? 1 : 0);
+        return true;
+    } else if (janet_bytes_view(constant, &bytes, &bytes_len)) {
+        if (header.type != mpack_type_str && header.type != mpack_type_bin) return false;
+        uint32_t n = header.payload < (uint32_t) bytes_len ? header.payload : (uint32_t) bytes_len;
+        *cmp = memcmp(data + pos + header.header_len, bytes, n);
+        if (*cmp == 0) *cmp = header.payload < (uint32_t) bytes_len ? -1 : (header.payload > (uint32_t) bytes_len ? 1 : 0);
+        return true;
+    } else if (janet_checktype(constant, JANET_BOOLEAN)) {
+        if (header.type != mpack_type_bool) return false;
+        *cmp = (data[pos] == 0xC3) - janet_unwrap_boolean(constant);
+        return true;
+    } else if (janet_checktype(constant, JANET_NIL)) {
+        if (header.type != mpack_type_nil) return false;
+        *cmp = 0;
+        return true;
+    }
+    return false;
+}
+
+static bool eval_msgpack_predicate(const uint8_t *data, size_t len, size_t pos, const struct msgpack_predicate *predicate) {
+    size_t value;
+    int cmp;
+    if (!find_msgpack_field(data, len, pos, &predicate->field, &value)) return false;
+    if (predicate->op == MSGPACK_SELECT_HAS) return true;
+    if (!compare_msgpack_constant(data, len, value, predicate->constant, &cmp)) {
+        // Values of different types are never equal, and never ordered
+        return predicate->op == MSGPACK_SELECT_NE;
+    }
+    switch (predicate->op) {
+        case MSGPACK_SELECT_EQ: return cmp == 0;
+        case MSGPACK_SELECT_NE: return cmp != 0;
+        case MSGPACK_SELECT_LT: return cmp < 0;
+        case MSGPACK_SELECT_LE: return cmp <= 0;
+        case MSGPACK_SELECT_GT: return cmp > 0;
+        case MSGPACK_SELECT_GE: return cmp >= 0;
+        default: return true;
+    }
+}
+
+static Janet wrap_aggregate(const struct msgpack_aggregate *aggregate, bool sum, bool min, bool max) {
+    bool has_min = min && aggregate->min_count > 0;
+    bool has_max = max && aggregate->max_count > 0;
+    JanetKV *st = janet_struct_begin(1 + sum + has_min + has_max);
+    janet_struct_put(st, janet_ckeywordv("count"), janet_wrap_number((double) aggregate->count));
+    if (sum) janet_struct_put(st, janet_ckeywordv("sum"), janet_wrap_number(aggregate->sum));
+    if (has_min) janet_struct_put(st, janet_ckeywordv("min"), janet_wrap_number(aggregate->min));
+    if (has_max) janet_struct_put(st, janet_ckeywordv("max"), janet_wrap_number(aggregate->max));
+    return janet_wrap_struct(janet_struct_end(st));
+}
+
+static void update_aggregate(struct msgpack_aggregate *aggregate, const uint8_t *data, size_t len, size_t pos, const struct msgpack_field *sum, const struct msgpack_field *min, const struct msgpack_field *max) {
+    size_t value;
+    double n;
+    aggregate->count++;
+    if (sum != NULL && find_msgpack_field(data, len, pos, sum, &value) && read_msgpack_number(data, len, value, &n)) {
+        aggregate->sum += n;
+    }
+    if (min != NULL && find_msgpack_field(data, len, pos, min, &value) && read_msgpack_number(data, len, value, &n)) {
+        if (aggregate->min_count++ == 0 || n < aggregate->min) aggregate->min = n;
+    }
+    if (max != NULL && find_msgpack_field(data, len, pos, max, &value) && read_msgpack_number(data, len, value, &n)) {
+        if (aggregate->max_count++ == 0 || n > aggregate->max) aggregate->max = n;
+    }
+}
+
+static Janet janet_msgpack_select(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 2);
+    const uint8_t *data;
+    size_t len;
+    msgpack_bytes_view(argv[0], &data, &len);
+    Janet query = argc > 1 ? argv[1] : janet_wrap_nil();
+    switch (janet_type(query)) {
+        case JANET_NIL:
+        case JANET_TABLE:
+        case JANET_STRUCT:
+            break;
+        default:
+            janet_panicf("Expected the query to be a table or struct, but got %t", query);
+    }
+    // Predicates
+    Janet where = get_option(query, "where");
+    const Janet *clauses = NULL;
+    int32_t clause_count = 0;
+    if (!janet_checktype(where, JANET_NIL) && !janet_indexed_view(where, &clauses, &clause_count)) {
+        janet_panicf("Expected :where to be an array or tuple of clauses, but got %t", where);
+    }
+    struct msgpack_predicate *predicates = janet_smalloc(sizeof(struct msgpack_predicate) * (clause_count > 0 ? clause_count : 1));
+    for (int32_t i = 0; i < clause_count; i++) {
+        const Janet *clause;
+        int32_t clause_len;
+        if (!janet_indexed_view(clauses[i], &clause, &clause_len) || clause_len < 2) {
+            janet_panicf("Expected a clause like [:= field value] or [:has field], but got %v", clauses[i]);
+        }
+        predicates[i].op = (enum msgpack_select_op) parse_named_enum(clause[0], "select operator", MSGPACK_SELECT_OP_ENUM);
+        if (clause_len != (predicates[i].op == MSGPACK_SELECT_HAS ? 2 : 3)) {
+            janet_panicf("Wrong number of arguments in select clause %v", clauses[i]);
+        }
+        parse_msgpack_field(clause[1], &predicates[i].field);
+        predicates[i].constant = clause_len > 2 ? clause[2] : janet_wrap_nil();
+    }
+    // Aggregates
+    const Janet fields[3] = {get_option(query, "sum"), get_option(query, "min"), get_option(query, "max")};
+    struct msgpack_field aggregate_fields[3];
+    const struct msgpack_field *sum = NULL, *min = NULL, *max = NULL;
+    for (int i = 0; i < 3; i++) {
+        if (janet_checktype(fields[i], JANET_NIL)) continue;
+        parse_msgpack_field(fields[i], &aggregate_fields[i]);
+        if (i == 0) sum = &aggregate_fields[i];
+        else if (i == 1) min = &aggregate_fields[i];
+        else max = &aggregate_fields[i];
+    }
+    Janet group_by = get_option(query, "group-by");
+    struct msgpack_field group_field;
+    if (!janet_checktype(group_by, JANET_NIL)) parse_msgpack_field(group_by, &group_field);
+    bool aggregating = janet_truthy(get_option(query, "count")) || sum != NULL || min != NULL || max != NULL ||
+        !janet_checktype(group_by, JANET_NIL);
+    int64_t limit = get_limit_option(query, "limit", -1);
+    Janet types = get_option(query, "decoded-types");
+
+    JanetArray *matches = aggregating ? NULL : janet_array(0);
+    struct msgpack_aggregate total = {0};
+    // Groups map the group's string to an index into group_states
+    JanetTable *groups = janet_checktype(group_by, JANET_NIL) ? NULL : janet_table(0);
+    struct msgpack_aggregate *group_states = NULL;
+    int32_t group_capacity = 0;
+    size_t pos = 0;
+    while (pos < len && !(matches != NULL && limit >= 0 && matches->count >= limit)) {
+        size_t end = skip_msgpack(data, len, pos);
+        bool matched = true;
+        for (int32_t i = 0; i < clause_count && matched; i++) {
+            matched = eval_msgpack_predicate(data, len, pos, &predicates[i]);
+        }
+        if (!matched) {
+            pos = end;
+            continue;
+        }
+        if (!aggregating) {
+            janet_array_push(matches, decode_msgpack_data(data + pos, end - pos, types, janet_wrap_nil()));
+        } else if (groups == NULL) {
+            update_aggregate(&total, data, len, pos, sum, min, max);
+        } else {
+            size_t value;
+            struct msgpack_header header;
+            // Records without a string in the group field are grouped under :nil
+            Janet group_key = janet_ckeywordv("nil");
+            if (find_msgpack_field(data, len, pos, &group_field, &value) &&
+                    read_msgpack_header(data, len, value, &header) && header.type == mpack_type_str &&
+                    header.payload <= len - value - header.header_len) {
+                group_key = janet_stringv(data + value + header.header_len, (int32_t) header.payload);
+            }
+            Janet index = janet_table_get(groups, group_key);
+            if (janet_checktype(index, JANET_NIL)) {
+                if (groups->count == group_capacity) {
+                    int32_t new_capacity = group_capacity == 0 ? 16 : group_capacity * 2;
+                    group_states = janet_srealloc(group_states, sizeof(struct msgpack_aggregate) * new_capacity);
+                    group_capacity = new_capacity;
+                }
+                index = janet_wrap_integer(groups->count);
+                memset(&group_states[groups->count], 0, sizeof(struct msgpack_aggregate));
+                janet_table_put(groups, group_key, index);
+            }
+            update_aggregate(&group_states[janet_unwrap_integer(index)], data, len, pos, sum, min, max);
+        }
+        pos = end;
+    }
+    janet_sfree(predicates);
+    if (matches != NULL) return janet_wrap_array(matches);
+    if (groups == NULL) return wrap_aggregate(&total, sum != NULL, min != NULL, max != NULL);
+    JanetTable *result = janet_table(groups->count);
+    for (int32_t i = 0; i < groups->capacity; i++) {
+        const JanetKV *kv = &groups->data[i];
+        if (janet_checktype(kv->key, JANET_NIL)) continue;
+        struct msgpack_aggregate *state = &group_states[janet_unwrap_integer(kv->value)];
+        janet_table_put(result, kv->key, wrap_aggregate(state, sum != NULL, min != NULL, max != NULL));
+    }
+    if (group_states != NULL) janet_sfree(group_states);
+    return janet_wrap_table(result);
+}
+
+/**********************/
+/* Hashing & Equality */
+/**********************/
+
+/*
+ * Compare & hash encoded values by what they decode to, without decoding.
+ *
+ * Numbers are equal whenever their values are, whatever their width or
+ * format, maps are unordered, and timestamps compare by the time they hold.
+ * Strings & bytes are distinct, as they decode to different types.
+ * Unlike Janet numbers, NaN is equal to itself.
+ */
+
+#define MSGPACK_HASH_P1 0x9E3779B185EBCA87ULL
+#define MSGPACK_HASH_P2 0xC2B2AE3D27D4EB4FULL
+#define MSGPACK_HASH_P3 0x165667B19E3779F9ULL
+#define MSGPACK_HASH_P4 0x85EBCA77C2B2AE63ULL
+#define MSGPACK_HASH_P5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t hash_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+static inline uint64_t hash_round(uint64_t acc, uint64_t input) {
+    return hash_rotl(acc + input * MSGPACK_HASH_P2, 31) * MSGPACK_HASH_P1;
+}
+static inline uint64_t hash_merge(uint64_t h, uint64_t input) {
+    return hash_rotl(h ^ hash_round(0, input), 27) * MSGPACK_HASH_P1 + MSGPACK_HASH_P4;
+}
+static inline uint64_t hash_avalanche(uint64_t h) {
+    h ^= h >> 33;
+    h *= MSGPACK_HASH_P2;
+    h ^= h >> 29;
+    h *= MSGPACK_HASH_P3;
+    h ^= h >> 32;
+    return h;
+}
+/**
+ * Hash a run of bytes, in the style of XXH64's short input path.
+ */
+static uint64_t hash_bytes(uint64_t seed, const uint8_t *data, size_t len) {
+    uint64_t h = seed + MSGPACK_HASH_P5 + (uint64_t) len;
+    while (len >= 8) {
+        uint64_t word = 0;
+        for (int i = 7; i >= 0; i--) word = (word << 8) | data[i];
+        h = hash_merge(h, word);
+        data += 8;
+        len -= 8;
+    }
+    if (len >= 4) {
+        uint64_t word = (uint64_t) data[0] | ((uint64_t) data[1] << 8) | ((uint64_t) data[2] << 16) | ((uint64_t) data[3] << 24);
+        h = hash_rotl(h ^ (word * MSGPACK_HASH_P1), 23) * MSGPACK_HASH_P2 + MSGPACK_HASH_P3;
+        data += 4;
+        len -= 4;
+    }
+    while (len > 0) {
+        h = hash_rotl(h ^ (*data * MSGPACK_HASH_P5), 11) * MSGPACK_HASH_P1;
+        data++;
+        len--;
+    }
+    return hash_avalanche(h);
+}
+
+/*
+ * A value reduced to a kind and 64 bits, so that equal scalars are
+ * bitwise equal whatever their encoding.
+ */
+enum msgpack_scalar_kind {
+    MSGPACK_KIND_NIL,
+    MSGPACK_KIND_BOOL,
+    MSGPACK_KIND_INT,
+    // Only for values above INT64_MAX
+    MSGPACK_KIND_UINT,
+    MSGPACK_KIND_DOUBLE,
+    MSGPACK_KIND_NAN
+};
+struct msgpack_normal_scalar {
+    enum msgpack_scalar_kind kind;
+    uint64_t bits;
+};
+static bool is_msgpack_scalar(mpack_type_t type) {
+    switch (type) {
+        case mpack_type_nil:
+        case mpack_type_bool:
+        case mpack_type_int:
+        case mpack_type_uint:
+        case mpack_type_float:
+        case mpack_type_double:
+            return true;
+        default:
+            return false;
+    }
+}
+static struct msgpack_normal_scalar normalize_msgpack_scalar(const uint8_t *start, const struct msgpack_header *header) {
+    struct msgpack_normal_scalar result = {MSGPACK_KIND_NIL, 0};
+    union msgpack_scalar value;
+    read_msgpack_scalar(start, header, &value);
+    switch (header->type) {
+        case mpack_type_bool:
+            result.kind = MSGPACK_KIND_BOOL;
+            result.bits = value.b;
+            break;
+        case mpack_type_int:
+            result.kind = MSGPACK_KIND_INT;
+            result.bits = (uint64_t) value.i;
+            break;
+        case mpack_type_uint:
+            result.kind = value.u > (uint64_t) INT64_MAX ? MSGPACK_KIND_UINT : MSGPACK_KIND_INT;
+            result.bits = value.u;
+            break;
+        case mpack_type_float:
+        case mpack_type_double: {
+            double d = value.d;
+            if (d != d) {
+                result.kind = MSGPACK_KIND_NAN;
+            } else if (d == floor(d) && d >= -9223372036854775808.0 && d < 9223372036854775808.0) {
+                result.kind = MSGPACK_KIND_INT;
+                result.bits = (uint64_t) (int64_t) d;
+            } else if (d == floor(d) && d >= 0 && d < 18446744073709551616.0) {
+                result.kind = MSGPACK_KIND_UINT;
+                result.bits = (uint64_t) d;
+            } else {
+                result.kind = MSGPACK_KIND_DOUBLE;
+                memcpy(&result.bits, &d, sizeof(d));
+            }
+            break;
+        }
+        default:
+            break;
+    }
+    return result;
+}
+/**
+ * Read the header at data[*pos], advancing past it, and panic if it's malformed or truncated.
+ */
+static void read_checked_header(const uint8_t *data, size_t len, size_t *pos, struct msgpack_header *header) {
+    if (!read_msgpack_header(data, len, *pos, header)) janet_panic("Error reading msgpack: invalid or truncated header");
+    *pos += header->header_len;
+    if (header->payload > len - *pos) janet_panic("unexpected end of msgpack input");
+}
+static uint64_t hash_msgpack(const uint8_t *data, size_t len, size_t *pos, int depth) {
+    if (depth > MSGPACK_SCAN_MAX_DEPTH) janet_panic("msgpack hashing recursed too deeply");
+    size_t start = *pos;
+    struct msgpack_header header;
+    read_checked_header(data, len, pos, &header);
+    const uint8_t *payload = data + *pos;
+    *pos += header.payload;
+    if (is_msgpack_scalar(header.type)) {
+        struct msgpack_normal_scalar scalar = normalize_msgpack_scalar(data + start, &header);
+        return hash_avalanche(hash_merge(MSGPACK_HASH_P5 + scalar.kind, scalar.bits));
+    }
+    switch (header.type) {
+        case mpack_type_str:
+        case mpack_type_bin:
+            return hash_bytes(header.type, payload, header.payload);
+        case mpack_type_ext: {
+            struct msgpack_timestamp timestamp;
+            if (header.exttype == MSGPACK_EXT_TIMESTAMP && read_msgpack_timestamp(payload, header.payload, &timestamp)) {
+                uint64_t h = hash_merge(MSGPACK_HASH_P5 + mpack_type_ext, (uint64_t) timestamp.seconds);
+                return hash_avalanche(hash_merge(h, timestamp.nanoseconds));
+            }
+            return hash_bytes(hash_merge(mpack_type_ext, (uint8_t) header.exttype), payload, header.payload);
+        }
+        case mpack_type_array: {
+            uint64_t h = hash_merge(MSGPACK_HASH_P5 + mpack_type_array, header.count);
+            for (uint32_t i = 0; i < header.count; i++) {
+                h = hash_merge(h, hash_msgpack(data, len, pos, depth + 1));
+            }
+            return hash_avalanche(h);
+        }
+        case mpack_type_map: {
+            // Entries are combined by addition, so their order doesn't matter
+            uint64_t sum = 0;
+            for (uint32_t i = 0; i < header.count; i++) {
+                uint64_t key = hash_msgpack(data, len, pos, depth + 1);
+                uint64_t value = hash_msgpack(data, len, pos, depth + 1);
+                sum += hash_avalanche(hash_merge(key, value));
+            }
+            return hash_avalanche(hash_merge(hash_merge(MSGPACK_HASH_P5 + mpack_type_map, header.count), sum));
+        }
+        default:
+            janet_panicf("Unsupported msgpack type: %s", mpack_type_to_string(header.type));
+    }
+}
+
+struct msgpack_map_entry {
+    uint64_t key_hash;
+    size_t key;
+    size_t value;
+};
+static int compare_map_entries(const void *a, const void *b) {
+    const struct msgpack_map_entry *x = a, *y = b;
+    return (x->key_hash > y->key_hash) - (x->key_hash < y->key_hash);
+}
+static bool msgpack_equal(const uint8_t *a, size_t a_len, size_t *a_pos, const uint8_t *b, size_t b_len, size_t *b_pos, int depth);
+/**
+ * Compare two maps whose headers have been read, regardless of the order of their entries.
+ *
+ * The entries of b are sorted by key hash, so each key of a is found by binary search.
+ */
+static bool msgpack_maps_equal(const uint8_t *a, size_t a_len, size_t *a_pos, const uint8_t *b, size_t b_len, size_t *b_pos, uint32_t count, int depth) {
+    struct msgpack_map_entry *entries = janet_smalloc(sizeof(struct msgpack_map_entry) * (size_t) (count ? count : 1));
+    for (uint32_t i = 0; i < count; i++) {
+        entries[i].key = *b_pos;
+        entries[i].key_hash = hash_msgpack(b, b_len, b_pos, depth + 1);
+        entries[i].value = *b_pos;
+        *b_pos = skip_msgpack(b, b_len, *b_pos);
+    }
+    qsort(entries, count, sizeof(struct msgpack_map_entry), compare_map_entries);
+    bool equal = true;
+    for (uint32_t i = 0; i < count && equal; i++) {
+        size_t key = *a_pos;
+        uint64_t key_hash = hash_msgpack(a, a_len, a_pos, depth + 1);
+        size_t lo = 0, hi = count;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (entries[mid].key_hash < key_hash) lo = mid + 1;
+            else hi = mid;
+        }
+        const struct msgpack_map_entry *match = NULL;
+        for (size_t j = lo; j < count && entries[j].key_hash == key_hash; j++) {
+            size_t x = key, y = entries[j].key;
+            if (msgpack_equal(a, a_len, &x, b, b_len, &y, depth + 1)) {
+                match = &entries[j];
+                break;
+            }
+        }
+        if (match == NULL) {
+            equal = false;
+        } else {
+            size_t value = match->value;
+            equal = msgpack_equal(a, a_len, a_pos, b, b_len, &value, depth + 1);
+        }
+    }
+    janet_sfree(entries);
+    return equal;
+}
+/**
+ * Compare the values at a[*a_pos] and b[*b_pos], advancing past both if they're equal.
+ */
+static bool msgpack_equal(const uint8_t *a, size_t a_len, size_t *a_pos, const uint8_t *b, size_t b_len, size_t *b_pos, int depth) {
+    if (depth > MSGPACK_SCAN_MAX_DEPTH) janet_panic("msgpack comparison recursed too deeply");
+    size_t a_start = *a_pos, b_start = *b_pos;
+    struct msgpack_header x, y;
+    read_checked_header(a, a_len, a_pos, &x);
+    read_checked_header(b, b_len, b_pos, &y);
+    const uint8_t *x_payload = a + *a_pos, *y_payload = b + *b_pos;
+    *a_pos += x.payload;
+    *b_pos += y.payload;
+    if (is_msgpack_scalar(x.type) && is_msgpack_scalar(y.type)) {
+        struct msgpack_normal_scalar xs = normalize_msgpack_scalar(a + a_start, &x);
+        struct msgpack_normal_scalar ys = normalize_msgpack_scalar(b + b_start, &y);
+        return xs.kind == ys.kind && xs.bits == ys.bits;
+    }
+    if (x.type != y.type) return false;
+    switch (x.type) {
+        case mpack_type_str:
+        case mpack_type_bin:
+            return x.payload == y.payload && memcmp(x_payload, y_payload, x.payload) == 0;
+        case mpack_type_ext: {
+            if (x.exttype != y.exttype) return false;
+            struct msgpack_timestamp xt, yt;
+            if (x.exttype == MSGPACK_EXT_TIMESTAMP
+                    && read_msgpack_timestamp(x_payload, x.payload, &xt)
+                    && read_msgpack_timestamp(y_payload, y.payload, &yt)) {
+                return xt.seconds == yt.seconds && xt.nanoseconds == yt.nanoseconds;
+            }
+            return x.payload == y.payload && memcmp(x_payload, y_payload, x.payload) == 0;
+        }
+        case mpack_type_array:
+            if (x.count != y.count) return false;
+            for (uint32_t i = 0; i < x.count; i++) {
+                if (!msgpack_equal(a, a_len, a_pos, b, b_len, b_pos, depth + 1)) return false;
+            }
+            return true;
+        case mpack_type_map:
+            if (x.count != y.count) return false;
+            return msgpack_maps_equal(a, a_len, a_pos, b, b_len, b_pos, x.count, depth);
+        default:
+            janet_panicf("Unsupported msgpack type: %s", mpack_type_to_string(x.type));
+    }
+}
+/**
+ * Reorder the `count` map entries encoded from buffer offset `start` to its end
+ * by the bytes of their keys, the same order sort_map_keys gives.
+ */
+static void sort_encoded_map_entries(JanetBuffer *buffer, int32_t start, uint32_t count) {
+    if (count < 2) return;
+    const uint8_t *data = buffer->data;
+    size_t len = (size_t) buffer->count;
+    struct msgpack_sort_key *keys = janet_smalloc(sizeof(struct msgpack_sort_key) * (size_t) count);
+    size_t *ends = janet_smalloc(sizeof(size_t) * (size_t) count);
+    size_t pos = (size_t) start;
+    for (uint32_t i = 0; i < count; i++) {
+        size_t key_end = skip_msgpack(data, len, pos);
+        keys[i].bytes = data + pos;
+        keys[i].len = (int32_t) (key_end - pos);
+        keys[i].slot = (int32_t) i;
+        pos = skip_msgpack(data, len, key_end);
+        ends[i] = pos;
+    }
+    qsort(keys, count, sizeof(struct msgpack_sort_key), compare_sort_keys);
+    size_t total = pos - (size_t) start;
+    uint8_t *sorted = janet_smalloc(total);
+    size_t offset = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        size_t entry_len = ends[keys[i].slot] - (size_t) (keys[i].bytes - data);
+        memcpy(sorted + offset, keys[i].bytes, entry_len);
+        offset += entry_len;
+    }
+    memcpy(buffer->data + start, sorted, total);
+    janet_sfree(sorted);
+    janet_sfree(ends);
+    janet_sfree(keys);
+}
+/**
+ * Re-encode the value at data[*pos] canonically, advancing past it.
+ *
+ * This gives raw values the same bytes :canonical gives the values they decode to.
+ */
+static void encode_canonical_raw(struct msgpack_encoder *encoder, const uint8_t *data, size_t len, size_t *pos, int depth) {
+    if (depth > MSGPACK_SCAN_MAX_DEPTH) janet_panic("msgpack encoding recursed too deeply");
+    size_t start = *pos;
+    struct msgpack_header header;
+    read_checked_header(data, len, pos, &header);
+    const uint8_t *payload = data + *pos;
+    *pos += header.payload;
+    // Every element takes at least a byte
+    if (header.count > len - *pos) janet_panic("unexpected end of msgpack input");
+    union msgpack_scalar value;
+    switch (header.type) {
+        case mpack_type_nil:
+        case mpack_type_bool:
+            janet_buffer_push_u8(encoder->buffer, data[start]);
+            break;
+        case mpack_type_int:
+            read_msgpack_scalar(data + start, &header, &value);
+            encode_msgpack_int(encoder, value.i, false);
+            break;
+        case mpack_type_uint:
+            read_msgpack_scalar(data + start, &header, &value);
+            encode_msgpack_int(encoder, (int64_t) value.u, /* actually unsigned */ true);
+            break;
+        case mpack_type_float:
+        case mpack_type_double:
+            read_msgpack_scalar(data + start, &header, &value);
+            encode_msgpack_double(encoder, value.d);
+            break;
+        case mpack_type_str:
+        case mpack_type_bin:
+            encode_msgpack_string(encoder, payload, header.payload,
+                header.type == mpack_type_str ? MSGPACK_STRING_STRING : MSGPACK_BYTES_STRING);
+            break;
+        case mpack_type_ext: {
+            struct msgpack_timestamp timestamp;
+            if (header.exttype == MSGPACK_EXT_TIMESTAMP && read_msgpack_timestamp(payload, header.payload, &timestamp)) {
+                encode_msgpack_timestamp(encoder, &timestamp);
+            } else {
+                encode_msgpack_ext(encoder, header.exttype, payload, header.payload);
+            }
+            break;
+        }
+        case mpack_type_array:
+            encode_msgpack_collection_length(encoder, (int32_t) header.count, 0x90, 0xDC);
+            for (uint32_t i = 0; i < header.count; i++) {
+                encode_canonical_raw(encoder, data, len, pos, depth + 1);
+            }
+            break;
+        case mpack_type_map: {
+            encode_msgpack_collection_length(encoder, (int32_t) header.count, 0x80, 0xDE);
+            int32_t entries = encoder->buffer->count;
+            for (uint32_t i = 0; i < header.count; i++) {
+                encode_canonical_raw(encoder, data, len, pos, depth + 1);
+                encode_canonical_raw(encoder, data, len, pos, depth + 1);
+            }
+            sort_encoded_map_entries(encoder->buffer, entries, header.count);
+            break;
+        }
+        default:
+            janet_panicf("Unsupported msgpack type: %s", mpack_type_to_string(header.type));
+    }
+}
+static Janet janet_msgpack_hash(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    const uint8_t *data;
+    size_t len;
+    msgpack_bytes_view(argv[0], &data, &len);
+    size_t pos = 0;
+    uint64_t hash = hash_msgpack(data, len, &pos, 0);
+    if (pos != len) janet_panic("Expected a single msgpack object, but found trailing bytes");
+    #ifdef JANET_INT_TYPES
+        return janet_wrap_u64(hash);
+    #else
+        // Only 53 bits fit in a Janet number
+        return janet_wrap_number((double) (hash >> 11));
+    #endif
+}
+static Janet janet_msgpack_equal(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    const uint8_t *a, *b;
+    size_t a_len, b_len;
+    msgpack_bytes_view(argv[0], &a, &a_len);
+    msgpack_bytes_view(argv[1], &b, &b_len);
+    size_t a_pos = 0, b_pos = 0;
+    bool equal = msgpack_equal(a, a_len, &a_pos, b, b_len, &b_pos, 0);
+    // Unequal values may stop early, so only equal ones are known to have been read in full
+    if (equal && (a_pos != a_len || b_pos != b_len)) {
+        janet_panic("Expected a single msgpack object, but found trailing bytes");
+    }
+    return janet_wrap_boolean(equal);
+}
+
+/********/
+/* JSON */
+/********/
+
+/*
+ * Transcoding between msgpack and JSON text, without materialising Janet values.
+ */
+
+static const char JSON_HEX_DIGITS[] = "0123456789abcdef";
+static const char BASE64_DIGITS[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/**
+ * Write a JSON string literal, copying runs of characters that need no escaping at once.
+ */
+static void write_json_string(JanetBuffer *buffer, const uint8_t *data, uint32_t len) {
+    janet_buffer_push_u8(buffer, '"');
+    uint32_t run = 0;
+    for (uint32_t i = 0; i < len; i++) {
+        uint8_t c = data[i];
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+        janet_buffer_push_bytes(buffer, data + run, (int32_t) (i - run));
+        run = i + 1;
+        switch (c) {
+            case '"': janet_buffer_push_cstring(buffer, "\\\""); break;
+            case '\\': janet_buffer_push_cstring(buffer, "\\\\"); break;
+            case '\n': janet_buffer_push_cstring(buffer, "\\n"); break;
+            case '\r': janet_buffer_push_cstring(buffer, "\\r"); break;
+            case '\t': janet_buffer_push_cstring(buffer, "\\t"); break;
+            case '\b': janet_buffer_push_cstring(buffer, "\\b"); break;
+            case '\f': janet_buffer_push_cstring(buffer, "\\f"); break;
+            default: {
+                uint8_t escape[6] = {'\\', 'u', '0', '0', JSON_HEX_DIGITS[c >> 4], JSON_HEX_DIGITS[c & 15]};
+                janet_buffer_push_bytes(buffer, escape, 6);
+                break;
+            }
+        }
+    }
+    janet_buffer_push_bytes(buffer, data + run, (int32_t) (len - run));
+    janet_buffer_push_u8(buffer, '"');
+}
+
+static void write_json_base64(JanetBuffer *buffer, const uint8_t *data, uint32_t len) {
+    janet_buffer_push_u8(buffer, '"');
+    for (uint32_t i = 0; i < len; i += 3) {
+        uint32_t bits = (uint32_t) data[i] << 16;
+        if (i + 1 < len) bits |= (uint32_t) data[i + 1] << 8;
+        if (i + 2 < len) bits |= data[i + 2];
+        uint8_t chunk[4] = {
+            BASE64_DIGITS[(bits >> 18) & 63],
+            BASE64_DIGITS[(bits >> 12) & 63],
+            i + 1 < len ? BASE64_DIGITS[(bits >> 6) & 63] : '=',
+            i + 2 < len ? BASE64_DIGITS[bits & 63] : '='
+        };
+        janet_buffer_push_bytes(buffer, chunk, 4);
+    }
+    janet_buffer_push_u8(buffer, '"');
+}
+
+/**
+ * The decimal point that snprintf & strtod use in the current locale.
+ *
+ * JSON always uses '.', whatever the locale of the host program.
+ */
+static char locale_decimal_point(void) {
+    const char *point = localeconv()->decimal_point;
+    return point != NULL && point[0] != '\0' ? point[0] : '.';
+}
+/**
+ * Write the shortest decimal form that reads back as the same double (or float).
+ *
+ * JSON has no representation for infinities or NaN, so they become null.
+ */
+static void write_json_double(JanetBuffer *buffer, double value, bool single) {
+    if (!isfinite(value)) {
+        janet_buffer_push_cstring(buffer, "null");
+        return;
+    }
+    char text[32];
+    // 9 significant digits always round-trip a float, and 17 a double
+    for (int precision = 1; precision <= 17; precision++) {
+        snprintf(text, sizeof(text), "%.*g", precision, value);
+        double parsed = strtod(text, NULL);
+        if (single ? (float) parsed == (float) value : parsed == value) break;
+    }
+    // %g switches to an exponent once there are fewer digits than the exponent (100 is 1e+02)
+    const char *exponent = strchr(text, 'e');
+    if (exponent != NULL) {
+        int power = atoi(exponent + 1);
+        if (power >= 0 && power < 17) snprintf(text, sizeof(text), "%.*g", power + 1, value);
+    }
+    char point = locale_decimal_point();
+    if (point != '.') {
+        for (char *c = text; *c != '\0'; c++) {
+            if (*c == point) *c = '.';
+        }
+    }
+    janet_buffer_push_cstring(buffer, text);
+}
+
+static void write_json_integer(JanetBuffer *buffer, const uint8_t *start, const struct msgpack_header *header) {
+    union msgpack_scalar value;
+    char text[24];
+    read_msgpack_scalar(start, header, &value);
+    if (header->type == mpack_type_uint) {
+        snprintf(text, sizeof(text), "%llu", (unsigned long long) value.u);
+    } else {
+        snprintf(text, sizeof(text), "%lld", (long long) value.i);
+    }
+    janet_buffer_push_cstring(buffer, text);
+}
+
+/**
+ * Transcode the object at data[*pos] to JSON, advancing *pos past it.
+ */
+static void msgpack_to_json(JanetBuffer *buffer, const uint8_t *data, size_t len, size_t *pos, int depth, bool is_key) {
+    struct msgpack_header header;
+    if (depth > MSGPACK_SCAN_MAX_DEPTH) janet_panic("msgpack nested too deeply");
+    if (!read_msgpack_header(data, len, *pos, &header)) {
+        janet_panic(*pos >= len ? "unexpected end of msgpack input" : "invalid msgpack type byte");
+    }
+    const uint8_t *start = data + *pos;
+    const uint8_t *payload = start + header.header_len;
+    *pos += header.header_len;
+    if (header.payload > len - *pos) janet_panic("unexpected end of msgpack input");
+    *pos += header.payload;
+    if (is_key && header.type != mpack_type_str) {
+        // Object keys must be strings, so integers are quoted
+        if (header.type != mpack_type_int && header.type != mpack_type_uint) {
+            janet_panicf("JSON object keys must be strings or integers, but got msgpack %s", mpack_type_to_string(header.type));
+        }
+        janet_buffer_push_u8(buffer, '"');
+        write_json_integer(buffer, start, &header);
+        janet_buffer_push_u8(buffer, '"');
+        return;
+    }
+    switch (header.type) {
+        case mpack_type_nil:
+            janet_buffer_push_cstring(buffer, "null");
+            break;
+        case mpack_type_bool:
+            janet_buffer_push_cstring(buffer, start[0] == 0xC3 ? "true" : "false");
+            break;
+        case mpack_type_int:
+        case mpack_type_uint:
+            write_json_integer(buffer, start, &header);
+            break;
+        case mpack_type_float:
+        case mpack_type_double: {
+            union msgpack_scalar value;
+            read_msgpack_scalar(start, &header, &value);
+            write_json_double(buffer, value.d, header.type == mpack_type_float);
+            break;
+        }
+        case mpack_type_str:
+            if (!msgpack_utf8_valid(payload, header.payload)) janet_panic("invalid UTF-8 in msgpack string");
+            write_json_string(buffer, payload, header.payload);
+            break;
+        case mpack_type_bin:
+            write_json_base64(buffer, payload, header.payload);
+            break;
+        case mpack_type_ext: {
+            struct msgpack_timestamp timestamp;
+            if (header.exttype != MSGPACK_EXT_TIMESTAMP) {
+                janet_panicf("Cannot convert msgpack ext type %d to JSON", header.exttype);
+            }
+            if (!read_msgpack_timestamp(payload, header.payload, &timestamp)) janet_panic("Invalid msgpack timestamp");
+            write_json_double(buffer, (double) timestamp.seconds + timestamp.nanoseconds / 1e9, false);
+            break;
+        }
+        case mpack_type_array:
+            janet_buffer_push_u8(buffer, '[');
+            for (uint32_t i = 0; i < header.count; i++) {
+                if (i > 0) janet_buffer_push_u8(buffer, ',');
+                msgpack_to_json(buffer, data, len, pos, depth + 1, false);
+            }
+            janet_buffer_push_u8(buffer, ']');
+            break;
+        case mpack_type_map:
+            janet_buffer_push_u8(buffer, '{');
+            for (uint32_t i = 0; i < header.count; i++) {
+                if (i > 0) janet_buffer_push_u8(buffer, ',');
+                msgpack_to_json(buffer, data, len, pos, depth + 1, true);
+                janet_buffer_push_u8(buffer, ':');
+                msgpack_to_json(buffer, data, len, pos, depth + 1, false);
+            }
+            janet_buffer_push_u8(buffer, '}');
+            break;
+        default:
+            janet_panicf("Unsupported msgpack type %s", mpack_type_to_string(header.type));
+    }
+}
+
+static Janet janet_msgpack_to_json(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 2);
+    const uint8_t *data;
+    size_t len;
+    msgpack_bytes_view(argv[0], &data, &len);
+    JanetBuffer *buffer = janet_optbuffer(argv, argc, 1, 64);
+    size_t pos = 0;
+    int32_t start = buffer->count;
+    msgpack_to_json(buffer, data, len, &pos, 0, false);
+    if (pos != len) {
+        buffer->count = start;
+        janet_panic("Expected a single msgpack object, but found trailing bytes");
+    }
+    return janet_wrap_buffer(buffer);
+}
+
+struct json_parser {
+    const uint8_t *text;
+    size_t len;
+    size_t pos;
+    struct msgpack_encoder *encoder;
+    // Holds strings with escapes & long numbers while they are converted
+    JanetBuffer *scratch;
+    // Element count of every array & object, in the order they open (native uint32s)
+    JanetBuffer *counts;
+    int32_t next_count;
+};
+
+static void json_error(const struct json_parser *parser, const char *message) {
+    janet_panicf("JSON error at offset %d: %s", (int32_t) parser->pos, message);
+}
+
+static void json_skip_whitespace(struct json_parser *parser) {
+    while (parser->pos < parser->len) {
+        uint8_t c = parser->text[parser->pos];
+        if (c != ' ' && c != '\n' && c != '\r' && c != '\t') break;
+        parser->pos++;
+    }
+}
+
+static void json_expect_literal(struct json_parser *parser, const char *literal) {
+    size_t n = strlen(literal);
+    if (parser->len - parser->pos < n || memcmp(parser->text + parser->pos, literal, n) != 0) {
+        json_error(parser, "invalid literal");
+    }
+    parser->pos += n;
+}
+
+static int json_hex_digit(uint8_t c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * Parse the four hex digits of a \u escape, starting at the 'u'.
+ */
+static uint32_t json_read_hex4(struct json_parser *parser) {
+    if (parser->len - parser->pos < 5) json_error(parser, "truncated unicode escape");
+    uint32_t value = 0;
+    for (int i = 1; i <= 4; i++) {
+        int digit = json_hex_digit(parser->text[parser->pos + i]);
+        if (digit < 0) json_error(parser, "invalid unicode escape");
+        value = (value << 4) | (uint32_t) digit;
+    }
+    parser->pos += 5;
+    return value;
+}
+
+static void json_push_utf8(JanetBuffer *buffer, uint32_t codepoint) {
+    if (codepoint < 0x80) {
+        janet_buffer_push_u8(buffer, (uint8_t) codepoint);
+    } else if (codepoint < 0x800) {
+        janet_buffer_push_u8(buffer, 0xC0 | (codepoint >> 6));
+        janet_buffer_push_u8(buffer, 0x80 | (codepoint & 0x3F));
+    } else if (codepoint < 0x10000) {
+        janet_buffer_push_u8(buffer, 0xE0 | (codepoint >> 12));
+        janet_buffer_push_u8(buffer, 0x80 | ((codepoint >> 6) & 0x3F));
+        janet_buffer_push_u8(buffer, 0x80 | (codepoint & 0x3F));
+    } else {
+        janet_buffer_push_u8(buffer, 0xF0 | (codepoint >> 18));
+        janet_buffer_push_u8(buffer, 0x80 | ((codepoint >> 12) & 0x3F));
+        janet_buffer_push_u8(buffer, 0x80 | ((codepoint >> 6) & 0x3F));
+        janet_buffer_push_u8(buffer, 0x80 | (codepoint & 0x3F));
+    }
+}
+
+/**
+ * Parse a string literal and encode it as a msgpack str.
+ *
+ * Strings without escapes are encoded straight from the input text.
+ */
+static void json_parse_string(struct json_parser *parser) {
+    const uint8_t *text = parser->text;
+    size_t start = ++parser->pos;
+    while (parser->pos < parser->len) {
+        uint8_t c = text[parser->pos];
+        if (c == '"' || c == '\\' || c < 0x20) break;
+        parser->pos++;
+    }
+    if (parser->pos >= parser->len) json_error(parser, "unterminated string");
+    const uint8_t *bytes = text + start;
+    size_t len = parser->pos - start;
+    if (text[parser->pos] != '"') {
+        JanetBuffer *scratch = parser->scratch;
+        scratch->count = 0;
+        janet_buffer_push_bytes(scratch, bytes, (int32_t) len);
+        while (true) {
+            if (parser->pos >= parser->len) json_error(parser, "unterminated string");
+            uint8_t c = text[parser->pos];
+            if (c == '"') break;
+            if (c < 0x20) json_error(parser, "control character in string");
+            if (c != '\\') {
+                janet_buffer_push_u8(scratch, c);
+                parser->pos++;
+                continue;
+            }
+            if (++parser->pos >= parser->len) json_error(parser, "unterminated string");
+            switch (text[parser->pos]) {
+                case '"': janet_buffer_push_u8(scratch, '"'); break;
+                case '\\': janet_buffer_push_u8(scratch, '\\'); break;
+                case '/': janet_buffer_push_u8(scratch, '/'); break;
+                case 'b': janet_buffer_push_u8(scratch, '\b'); break;
+                case 'f': janet_buffer_push_u8(scratch, '\f'); break;
+                case 'n': janet_buffer_push_u8(scratch, '\n'); break;
+                case 'r': janet_buffer_push_u8(scratch, '\r'); break;
+                case 't': janet_buffer_push_u8(scratch, '\t'); break;
+                case 'u': {
+                    uint32_t codepoint = json_read_hex4(parser);
+                    if (codepoint >= 0xD800 && codepoint <= 0xDBFF) {
+                        // A high surrogate must be followed by an escaped low surrogate
+                        if (parser->len - parser->pos < 2 || text[parser->pos] != '\\' || text[parser->pos + 1] != 'u') {
+                            json_error(parser, "unpaired surrogate");
+                        }
+                        parser->pos++;
+                        uint32_t low = json_read_hex4(parser);
+                        if (low < 0xDC00 || low > 0xDFFF) json_error(parser, "unpaired surrogate");
+                        codepoint = 0x10000 + ((codepoint - 0xD800) << 10) + (low - 0xDC00);
+                    } else if (codepoint >= 0xDC00 && codepoint <= 0xDFFF) {
+                        json_error(parser, "unpaired surrogate");
+                    }
+                    json_push_utf8(scratch, codepoint);
+                    // json_read_hex4 already advanced past the escape
+                    continue;
+                }
+                default:
+                    json_error(parser, "invalid escape");
+            }
+            parser->pos++;
+        }
+        bytes = scratch->data;
+        len = (size_t) scratch->count;
+    }
+    if (!msgpack_utf8_valid(bytes, len)) json_error(parser, "invalid UTF-8 in string");
+    if (len > UINT32_MAX) json_error(parser, "string is too long");
+    encode_msgpack_string(parser->encoder, bytes, (uint32_t) len, MSGPACK_STRING_STRING);
+    // Skip the closing quote
+    parser->pos++;
+}
+
+/**
+ * Parse a number, encoding integers as the smallest msgpack int and everything else
+ * (including -0) as a double.
+ */
+static void json_parse_number(struct json_parser *parser) {
+    const uint8_t *text = parser->text;
+    size_t start = parser->pos;
+    bool negative = text[parser->pos] == '-';
+    bool integral = true;
+    bool overflow = false;
+    uint64_t magnitude = 0;
+    if (negative) parser->pos++;
+    if (parser->pos >= parser->len || text[parser->pos] < '0' || text[parser->pos] > '9') {
+        json_error(parser, "invalid number");
+    }
+    if (text[parser->pos] == '0') {
+        parser->pos++;
+    } else {
+        while (parser->pos < parser->len && text[parser->pos] >= '0' && text[parser->pos] <= '9') {
+            uint64_t digit = text[parser->pos++] - '0';
+            if (magnitude > (UINT64_MAX - digit) / 10) overflow = true;
+            magnitude = magnitude * 10 + digit;
+        }
+    }
+    if (parser->pos < parser->len && text[parser->pos] == '.') {
+        integral = false;
+        parser->pos++;
+        size_t digits = parser->pos;
+        while (parser->pos < parser->len && text[parser->pos] >= '0' && text[parser->pos] <= '9') parser->pos++;
+        if (parser->pos == digits) json_error(parser, "invalid number");
+    }
+    if (parser->pos < parser->len && (text[parser->pos] == 'e' || text[parser->pos] == 'E')) {
+        integral = false;
+        parser->pos++;
+        if (parser->pos < parser->len && (text[parser->pos] == '+' || text[parser->pos] == '-')) parser->pos++;
+        size_t digits = parser->pos;
+        while (parser->pos < parser->len && text[parser->pos] >= '0' && text[parser->pos] <= '9') parser->pos++;
+        if (parser->pos == digits) json_error(parser, "invalid number");
+    }
+    // -0 is only representable as a double
+    if (integral && !overflow && !(negative && magnitude == 0)) {
+        if (!negative) {
+            encode_msgpack_int(parser->encoder, (int64_t) magnitude, true);
+            return;
+        } else if (magnitude <= (UINT64_C(1) << 63)) {
+            encode_msgpack_int(parser->encoder, (int64_t) (0 - magnitude), false);
+            return;
+        }
+    }
+    // strtod needs a terminated copy of the text
+    JanetBuffer *scratch = parser->scratch;
+    scratch->count = 0;
+    janet_buffer_push_bytes(scratch, text + start, (int32_t) (parser->pos - start));
+    janet_buffer_push_u8(scratch, 0);
+    char point = locale_decimal_point();
+    if (point != '.') {
+        for (int32_t i = 0; i < scratch->count; i++) {
+            if (scratch->data[i] == '.') scratch->data[i] = (uint8_t) point;
+        }
+    }
+    union {
+        double d;
+        uint64_t i;
+    } bytes;
+    bytes.d = strtod((const char*) scratch->data, NULL);
+    janet_buffer_push_u8(parser->encoder->buffer, 0xCB);
+    janet_buffer_push_u64(parser->encoder->buffer, ensure_bigendian(bytes.i));
+}
+
+static uint32_t json_get_count(const JanetBuffer *counts, int32_t offset) {
+    uint32_t count;
+    memcpy(&count, counts->data + offset, sizeof(count));
+    return count;
+}
+static void json_set_count(JanetBuffer *counts, int32_t offset, uint32_t count) {
+    memcpy(counts->data + offset, &count, sizeof(count));
+}
+/**
+ * Count the elements of every array & object up front, so that each header can be
+ * written at its final width. Patching the headers afterwards would shift everything
+ * after them, once per level of nesting.
+ *
+ * This only follows the structure, json_parse_value is what validates it.
+ */
+static void json_count_elements(struct json_parser *parser) {
+    JanetBuffer *counts = parser->counts;
+    // Offsets into counts of the containers still open
+    int32_t open[MSGPACK_SCAN_MAX_DEPTH + 1];
+    int32_t depth = 0;
+    const uint8_t *text = parser->text;
+    for (size_t i = 0; i < parser->len; i++) {
+        uint8_t c = text[i];
+        switch (c) {
+            case ' ':
+            case '\n':
+            case '\r':
+            case '\t':
+            case ':':
+                continue;
+            case ',':
+                if (depth > 0) {
+                    uint32_t count = json_get_count(counts, open[depth - 1]);
+                    if (count < UINT32_MAX) json_set_count(counts, open[depth - 1], count + 1);
+                }
+                continue;
+            case ']':
+            case '}':
+                if (depth > 0) depth--;
+                continue;
+            default:
+                break;
+        }
+        // Anything else is (part of) a value, so the enclosing container isn't empty
+        if (depth > 0 && json_get_count(counts, open[depth - 1]) == 0) json_set_count(counts, open[depth - 1], 1);
+        if (c == '"') {
+            for (i++; i < parser->len && text[i] != '"'; i++) {
+                if (text[i] == '\\') i++;
+            }
+        } else if (c == '[' || c == '{') {
+            // Too deep to parse anyway
+            if (depth > MSGPACK_SCAN_MAX_DEPTH) return;
+            open[depth++] = counts->count;
+            uint32_t zero = 0;
+            janet_buffer_push_bytes(counts, (const uint8_t*) &zero, sizeof(zero));
+        }
+    }
+}
+
+static void json_parse_value(struct json_parser *parser, int depth) {
+    if (depth > MSGPACK_SCAN_MAX_DEPTH) json_error(parser, "nested too deeply");
+    json_skip_whitespace(parser);
+    if (parser->pos >= parser->len) json_error(parser, "unexpected end of input");
+    switch (parser->text[parser->pos]) {
+        case '{':
+        case '[': {
+            bool is_map = parser->text[parser->pos] == '{';
+            uint8_t close = is_map ? '}' : ']';
+            if (parser->next_count * 4 >= parser->counts->count) json_error(parser, "unbalanced brackets");
+            uint32_t expected = json_get_count(parser->counts, parser->next_count * 4);
+            parser->next_count++;
+            if (expected > INT32_MAX) json_error(parser, "too many elements");
+            if (is_map) {
+                encode_msgpack_collection_length(parser->encoder, (int32_t) expected, 0x80, 0xDE);
+            } else {
+                encode_msgpack_collection_length(parser->encoder, (int32_t) expected, 0x90, 0xDC);
+            }
+            uint32_t count = 0;
+            parser->pos++;
+            json_skip_whitespace(parser);
+            if (parser->pos < parser->len && parser->text[parser->pos] == close) {
+                parser->pos++;
+                if (expected != 0) json_error(parser, "unbalanced brackets");
+                break;
+            }
+            while (true) {
+                if (is_map) {
+                    json_skip_whitespace(parser);
+                    if (parser->pos >= parser->len || parser->text[parser->pos] != '"') json_error(parser, "expected a string key");
+                    json_parse_string(parser);
+                    json_skip_whitespace(parser);
+                    if (parser->pos >= parser->len || parser->text[parser->pos] != ':') json_error(parser, "expected ':'");
+                    parser->pos++;
+                }
+                json_parse_value(parser, depth + 1);
+                if (count == UINT32_MAX) json_error(parser, "too many elements");
+                count++;
+                json_skip_whitespace(parser);
+                if (parser->pos < parser->len && parser->text[parser->pos] == ',') {
+                    parser->pos++;
+                } else if (parser->pos < parser->len && parser->text[parser->pos] == close) {
+                    parser->pos++;
+                    break;
+                } else {
+                    json_error(parser, is_map ? "expected ',' or '}'" : "expected ',' or ']'");
+                }
+            }
+            if (count != expected) json_error(parser, "unbalanced brackets");
+            break;
+        }
+        case '"':
+            json_parse_string(parser);
+            break;
+        case 't':
+            json_expect_literal(parser, "true");
+            janet_buffer_push_u8(parser->encoder->buffer, 0xC3);
+            break;
+        case 'f':
+            json_expect_literal(parser, "false");
+            janet_buffer_push_u8(parser->encoder->buffer, 0xC2);
+            break;
+        case 'n':
+            json_expect_literal(parser, "null");
+            janet_buffer_push_u8(parser->encoder->buffer, 0xC0);
+            break;
+        default:
+            json_parse_number(parser);
+            break;
+    }
+}
+
+static Janet janet_msgpack_from_json(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 2);
+    const uint8_t *text;
+    size_t len;
+    msgpack_bytes_view(argv[0], &text, &len);
+    JanetBuffer *buffer = janet_optbuffer(argv, argc, 1, len > INT32_MAX ? INT32_MAX : (int32_t) len);
+    struct msgpack_encoder encoder = {
+        .buffer = buffer,
+        .string_type = MSGPACK_STRING_STRING,
+        .buffer_type = MSGPACK_BYTES_STRING,
+    };
+    struct json_parser parser = {
+        .text = text,
+        .len = len,
+        .pos = 0,
+        .encoder = &encoder,
+        .scratch = janet_buffer(64),
+        .counts = janet_buffer(64),
+        .next_count = 0
+    };
+    json_count_elements(&parser);
+    json_parse_value(&parser, 0);
+    json_skip_whitespace(&parser);
+    if (parser.pos != parser.len) json_error(&parser, "trailing characters after value");
+    return janet_wrap_buffer(buffer);
+}
+
+/***********/
+/* Schemas */
+/***********/
+
+/*
+ * Compiled descriptions of a fixed message shape, such as
+ * {:id :int :name :str :tags [:str]}.
+ *
+ * Records always encode the same keys in the same order, so the map header &
+ * every key are encoded once at compile time and copied out on each use, and
+ * values are encoded by their declared type instead of janet_type().
+ */
+
+enum msgpack_schema_kind {
+    MSGPACK_SCHEMA_ANY,
+    MSGPACK_SCHEMA_INT,
+    MSGPACK_SCHEMA_FLOAT,
+    MSGPACK_SCHEMA_STR,
+    MSGPACK_SCHEMA_BIN,
+    MSGPACK_SCHEMA_BOOL,
+    MSGPACK_SCHEMA_ARRAY,
+    MSGPACK_SCHEMA_RECORD
+};
+static const struct enum_entry MSGPACK_SCHEMA_TYPE_ENUM[] = {
+    {"any", MSGPACK_SCHEMA_ANY},
+    {"int", MSGPACK_SCHEMA_INT},
+    {"integer", MSGPACK_SCHEMA_INT},
+    {"float", MSGPACK_SCHEMA_FLOAT},
+    {"double", MSGPACK_SCHEMA_FLOAT},
+    {"number", MSGPACK_SCHEMA_FLOAT},
+    {"str", MSGPACK_SCHEMA_STR},
+    {"string", MSGPACK_SCHEMA_STR},
+    {"bin", MSGPACK_SCHEMA_BIN},
+    {"bytes", MSGPACK_SCHEMA_BIN},
+    {"bool", MSGPACK_SCHEMA_BOOL},
+    {"boolean", MSGPACK_SCHEMA_BOOL},
+    {NULL, 0}
+};
+
+// Indexed by enum msgpack_schema_kind, for error messages
+static const char *const MSGPACK_SCHEMA_KIND_NAMES[] = {
+    "any value", "an int", "a float", "a str", "a bin", "a bool", "an array", "a map"
+};
+
+struct msgpack_schema_field;
+struct msgpack_schema_node {
+    enum msgpack_schema_kind kind;
+    // Element type of arrays
+    struct msgpack_schema_node *element;
+    // Fields of records, sorted by key
+    struct msgpack_schema_field *fields;
+    int32_t field_count;
+    // The map header of records
+    uint8_t header[5];
+    uint8_t header_len;
+};
+struct msgpack_schema_field {
+    // Always a keyword, like the keys from decode
+    Janet key;
+    // The key as encoded msgpack
+    uint8_t *encoded_key;
+    uint32_t encoded_key_len;
+    struct msgpack_schema_node *type;
+};
+
+struct msgpack_schema {
+    struct msgpack_schema_node *root;
+};
+
+static void free_schema_node(struct msgpack_schema_node *node) {
+    if (node == NULL) return;
+    free_schema_node(node->element);
+    for (int32_t i = 0; i < node->field_count; i++) {
+        janet_free(node->fields[i].encoded_key);
+        free_schema_node(node->fields[i].type);
+    }
+    janet_free(node->fields);
+    janet_free(node);
+}
+static void mark_schema_node(const struct msgpack_schema_node *node) {
+    if (node == NULL) return;
+    mark_schema_node(node->element);
+    for (int32_t i = 0; i < node->field_count; i++) {
+        janet_mark(node->fields[i].key);
+        mark_schema_node(node->fields[i].type);
+    }
+}
+static int schema_gc(void *p, size_t len) {
+    (void) len;
+    struct msgpack_schema *schema = p;
+    free_schema_node(schema->root);
+    schema->root = NULL;
+    return 0;
+}
+static int schema_gcmark(void *p, size_t len) {
+    (void) len;
+    mark_schema_node(((struct msgpack_schema*) p)->root);
+    return 0;
+}
+static int schema_get(void *p, Janet key, Janet *out);
+static const JanetAbstractType msgpack_schema_type = {
+    "msgpack/schema",
+    schema_gc,
+    schema_gcmark,
+    schema_get,
+    JANET_ATEND_GET
+};
+
+static int compare_schema_kvs(const void *a, const void *b) {
+    return janet_compare(((const JanetKV*) a)->key, ((const JanetKV*) b)->key);
+}
+
+/**
+ * Compile a schema description into *out.
+ *
+ * Nodes are linked in as soon as they are allocated, so everything is freed
+ * with the schema even if compilation fails part way.
+ */
+static void compile_schema_node(Janet description, struct msgpack_schema_node **out, int depth) {
+    if (depth > JANET_RECURSION_GUARD) janet_panic("Schema nested too deeply");
+    struct msgpack_schema_node *node = janet_malloc(sizeof(struct msgpack_schema_node));
+    if (node == NULL) janet_panic("out of memory compiling msgpack schema");
+    memset(node, 0, sizeof(struct msgpack_schema_node));
+    *out = node;
+    const Janet *items;
+    int32_t len;
+    const JanetKV *kvs;
+    int32_t count, capacity;
+    if (janet_checktype(description, JANET_KEYWORD) || janet_checktype(description, JANET_SYMBOL)) {
+        node->kind = (enum msgpack_schema_kind) parse_named_enum(description, "schema type", MSGPACK_SCHEMA_TYPE_ENUM);
+    } else if (janet_indexed_view(description, &items, &len)) {
+        if (len != 1) janet_panicf("Expected an array schema to have one element type, but got %v", description);
+        node->kind = MSGPACK_SCHEMA_ARRAY;
+        compile_schema_node(items[0], &node->element, depth + 1);
+    } else if (janet_dictionary_view(description, &kvs, &count, &capacity)) {
+        node->kind = MSGPACK_SCHEMA_RECORD;
+        JanetKV *sorted = janet_smalloc(sizeof(JanetKV) * (count > 0 ? count : 1));
+        int32_t n = 0;
+        for (int32_t i = 0; i < capacity; i++) {
+            Janet key = kvs[i].key;
+            if (janet_checktype(key, JANET_NIL)) continue;
+            if (janet_checktype(key, JANET_STRING)) {
+                key = janet_keywordv(janet_unwrap_string(key), janet_string_length(janet_unwrap_string(key)));
+            } else if (!janet_checktype(key, JANET_KEYWORD)) {
+                janet_panicf("Expected schema keys to be keywords or strings, but got %v", key);
+            }
+            sorted[n].key = key;
+            sorted[n].value = kvs[i].value;
+            n++;
+        }
+        // Sorting the keywords orders them by their bytes, as find_schema_field expects
+        qsort(sorted, (size_t) n, sizeof(JanetKV), compare_schema_kvs);
+        node->fields = janet_malloc(sizeof(struct msgpack_schema_field) * (n > 0 ? n : 1));
+        if (node->fields == NULL) janet_panic("out of memory compiling msgpack schema");
+        memset(node->fields, 0, sizeof(struct msgpack_schema_field) * (n > 0 ? n : 1));
+        node->field_count = n;
+        struct msgpack_encoder encoder = {
+            .buffer = janet_buffer(16),
+            .string_type = MSGPACK_STRING_STRING,
+            .buffer_type = MSGPACK_BYTES_STRING,
+        };
+        encode_msgpack_collection_length(&encoder, n, 0x80, 0xDE);
+        memcpy(node->header, encoder.buffer->data, encoder.buffer->count);
+        node->header_len = (uint8_t) encoder.buffer->count;
+        for (int32_t i = 0; i < n; i++) {
+            struct msgpack_schema_field *field = &node->fields[i];
+            const uint8_t *name = janet_unwrap_keyword(sorted[i].key);
+            int32_t name_len = janet_string_length(name);
+            field->key = sorted[i].key;
+            encoder.buffer->count = 0;
+            encode_msgpack_string(&encoder, name, (uint32_t) name_len, MSGPACK_STRING_STRING);
+            field->encoded_key = janet_malloc((size_t) encoder.buffer->count);
+            if (field->encoded_key == NULL) janet_panic("out of memory compiling msgpack schema");
+            memcpy(field->encoded_key, encoder.buffer->data, encoder.buffer->count);
+            field->encoded_key_len = (uint32_t) encoder.buffer->count;
+            compile_schema_node(sorted[i].value, &field->type, depth + 1);
+        }
+        janet_sfree(sorted);
+    } else {
+        janet_panicf("Expected a type name, [element-type] or {key type ...} in schema, but got %v", description);
+    }
+}
+
+static bool schema_int_value(Janet value, int64_t *out, bool *is_unsigned) {
+    *is_unsigned = false;
+    if (janet_checktype(value, JANET_NUMBER)) {
+        double d = janet_unwrap_number(value);
+        // Doubles are only exact integers up to 2^53
+        if (d != floor(d) || fabs(d) > 9007199254740992.0) return false;
+        *out = (int64_t) d;
+        return true;
+    }
+    #ifdef JANET_INT_TYPES
+    switch (janet_is_int(value)) {
+        case JANET_INT_S64:
+            *out = janet_unwrap_s64(value);
+            return true;
+        case JANET_INT_U64:
+            *out = (int64_t) janet_unwrap_u64(value);
+            *is_unsigned = true;
+            return true;
+        default:
+            break;
+    }
+    #endif
+    return false;
+}
+
+static void encode_msgpack_schema(struct msgpack_encoder *encoder, const struct msgpack_schema_node *node, Janet value, int depth) {
+    if (depth > JANET_RECURSION_GUARD) janet_panic("recursed too deeply");
+    JanetBuffer *buffer = encoder->buffer;
+    switch (node->kind) {
+        case MSGPACK_SCHEMA_ANY:
+            encode_msgpack(encoder, value, depth);
+            return;
+        case MSGPACK_SCHEMA_INT: {
+            int64_t n;
+            bool is_unsigned;
+            if (!schema_int_value(value, &n, &is_unsigned)) janet_panicf("Expected an integer, but got %v", value);
+            encode_msgpack_int(encoder, n, is_unsigned);
+            return;
+        }
+        case MSGPACK_SCHEMA_FLOAT:
+            // Schema decoding accepts ints & floats here too
+            if (!janet_checktype(value, JANET_NUMBER)) janet_panicf("Expected a number, but got %v", value);
+            encode_msgpack_double(encoder, janet_unwrap_number(value));
+            return;
+        case MSGPACK_SCHEMA_STR:
+        case MSGPACK_SCHEMA_BIN: {
+            const uint8_t *data;
+            int32_t len;
+            if (!janet_bytes_view(value, &data, &len)) janet_panicf("Expected a string, but got %v", value);
+            encode_msgpack_string(encoder, data, (uint32_t) len,
+                node->kind == MSGPACK_SCHEMA_STR ? MSGPACK_STRING_STRING : MSGPACK_BYTES_STRING);
+            return;
+        }
+        case MSGPACK_SCHEMA_BOOL:
+            if (!janet_checktype(value, JANET_BOOLEAN)) janet_panicf("Expected a boolean, but got %v", value);
+            janet_buffer_push_u8(buffer, janet_unwrap_boolean(value) ? 0xC3 : 0xC2);
+            return;
+        case MSGPACK_SCHEMA_ARRAY: {
+            const Janet *items;
+            int32_t len;
+            if (!janet_indexed_view(value, &items, &len)) janet_panicf("Expected an array or tuple, but got %v", value);
+            encode_msgpack_collection_length(encoder, len, 0x90, 0xDC);
+            for (int32_t i = 0; i < len; i++) {
+                encode_msgpack_schema(encoder, node->element, items[i], depth + 1);
+            }
+            return;
+        }
+        case MSGPACK_SCHEMA_RECORD: {
+            bool is_table = janet_checktype(value, JANET_TABLE);
+            if (!is_table && !janet_checktype(value, JANET_STRUCT)) {
+                janet_panicf("Expected a table or struct, but got %v", value);
+            }
+            janet_buffer_push_bytes(buffer, node->header, node->header_len);
+            for (int32_t i = 0; i < node->field_count; i++) {
+                const struct msgpack_schema_field *field = &node->fields[i];
+                Janet field_value = is_table
+                    ? janet_table_get(janet_unwrap_table(value), field->key)
+                    : janet_struct_get(janet_unwrap_struct(value), field->key);
+                if (janet_checktype(field_value, JANET_NIL) && field->type->kind != MSGPACK_SCHEMA_ANY) {
+                    janet_panicf("Missing field %v", field->key);
+                }
+                janet_buffer_push_bytes(buffer, field->encoded_key, (int32_t) field->encoded_key_len);
+                encode_msgpack_schema(encoder, field->type, field_value, depth + 1);
+            }
+            return;
+        }
+    }
+}
+
+static Janet cfun_schema_encode(int32_t argc, Janet *argv) {
+    janet_arity(argc, 2, 3);
+    struct msgpack_schema *schema = janet_getabstract(argv, 0, &msgpack_schema_type);
+    struct msgpack_encoder encoder = {
+        .buffer = janet_optbuffer(argv, argc, 2, 32),
+        .string_type = MSGPACK_STRING_STRING,
+        .buffer_type = MSGPACK_BYTES_STRING,
+    };
+    encode_msgpack_schema(&encoder, schema->root, argv[1], 0);
+    return janet_wrap_buffer(encoder.buffer);
+}
+
+/**
+ * Find the field named by a key, using binary search over the sorted fields.
+ *
+ * Fields are sorted with janet_compare, which orders strings by their bytes and then by length.
+ */
+static int32_t find_schema_field(const struct msgpack_schema_node *node, const uint8_t *name, uint32_t name_len) {
+    int32_t low = 0, high = node->field_count;
+    while (low < high) {
+        int32_t mid = low + (high - low) / 2;
+        const uint8_t *field_name = janet_unwrap_keyword(node->fields[mid].key);
+        uint32_t field_len = (uint32_t) janet_string_length(field_name);
+        int cmp = memcmp(field_name, name, field_len < name_len ? field_len : name_len);
+        if (cmp == 0) cmp = field_len < name_len ? -1 : (field_len > name_len ? 1 : 0);
+        if (cmp == 0) return mid;
+        if (cmp < 0) low = mid + 1;
+        else high = mid;
+    }
+    return -1;
+}
+
+static bool schema_field_matches(const struct msgpack_schema_field *field, const uint8_t *name, uint32_t name_len) {
+    const uint8_t *field_name = janet_unwrap_keyword(field->key);
+    return (uint32_t) janet_string_length(field_name) == name_len && memcmp(field_name, name, name_len) == 0;
+}
+
+/**
+ * Decode the object at data[*pos] as described by a schema, advancing *pos past it.
+ */
+static Janet decode_msgpack_schema(const struct msgpack_schema_node *node, const uint8_t *data, size_t len, size_t *pos, int depth) {
+    if (depth > JANET_RECURSION_GUARD) janet_panic("recursed too deeply");
+    if (node->kind == MSGPACK_SCHEMA_ANY) {
+        size_t start = *pos;
+        *pos = skip_msgpack(data, len, start);
+        return decode_msgpack_data(data + start, *pos - start, janet_wrap_nil(), janet_wrap_nil());
+    }
+    struct msgpack_header header;
+    if (!read_msgpack_header(data, len, *pos, &header)) {
+        janet_panic(*pos >= len ? "unexpected end of msgpack input" : "invalid msgpack type byte");
+    }
+    const uint8_t *start = data + *pos;
+    const uint8_t *payload = start + header.header_len;
+    *pos += header.header_len;
+    if (header.payload > len - *pos) janet_panic("unexpected end of msgpack input");
+    *pos += header.payload;
+    switch (node->kind) {
+        case MSGPACK_SCHEMA_INT: {
+            union msgpack_scalar value;
+            if (header.type != mpack_type_int && header.type != mpack_type_uint) break;
+            read_msgpack_scalar(start, &header, &value);
+            return header.type == mpack_type_int ? wrap_decoded_int(value.i) : wrap_decoded_uint(value.u);
+        }
+        case MSGPACK_SCHEMA_FLOAT: {
+            union msgpack_scalar value;
+            if (header.type == mpack_type_float || header.type == mpack_type_double) {
+                read_msgpack_scalar(start, &header, &value);
+                return janet_wrap_number(value.d);
+            } else if (header.type == mpack_type_int || header.type == mpack_type_uint) {
+                read_msgpack_scalar(start, &header, &value);
+                return janet_wrap_number(header.type == mpack_type_int ? (double) value.i : (double) value.u);
+            }
+            break;
+        }
+        case MSGPACK_SCHEMA_STR:
+            if (header.type != mpack_type_str) break;
+            return janet_stringv(payload, (int32_t) header.payload);
+        case MSGPACK_SCHEMA_BIN: {
+            if (header.type != mpack_type_bin && header.type != mpack_type_str) break;
+            JanetBuffer *buffer = janet_buffer((int32_t) header.payload);
+            janet_buffer_push_bytes(buffer, payload, (int32_t) header.payload);
+            return janet_wrap_buffer(buffer);
+        }
+        case MSGPACK_SCHEMA_BOOL:
+            if (header.type != mpack_type_bool) break;
+            return janet_wrap_boolean(start[0] == 0xC3);
+        case MSGPACK_SCHEMA_ARRAY: {
+            if (header.type != mpack_type_array) break;
+            // Every element needs at least one byte
+            if (header.count > len - *pos) janet_panic("msgpack array is longer than the input");
+            JanetArray *array = janet_array((int32_t) header.count);
+            for (uint32_t i = 0; i < header.count; i++) {
+                janet_array_push(array, decode_msgpack_schema(node->element, data, len, pos, depth + 1));
+            }
+            return janet_wrap_array(array);
+        }
+        case MSGPACK_SCHEMA_RECORD: {
+            if (header.type != mpack_type_map) break;
+            Janet *values = janet_smalloc(sizeof(Janet) * (node->field_count > 0 ? node->field_count : 1));
+            for (int32_t i = 0; i < node->field_count; i++) values[i] = janet_wrap_nil();
+            // Keys are usually in the order we encode them, so try the next field first
+            int32_t expected = 0;
+            for (uint32_t i = 0; i < header.count; i++) {
+                struct msgpack_header key;
+                if (!read_msgpack_header(data, len, *pos, &key) || key.type != mpack_type_str ||
+                        key.payload > len - *pos - key.header_len) {
+                    janet_panic("Expected a string key in msgpack record");
+                }
+                const uint8_t *name = data + *pos + key.header_len;
+                *pos += key.header_len + key.payload;
+                int32_t field;
+                if (expected < node->field_count && schema_field_matches(&node->fields[expected], name, key.payload)) {
+                    field = expected;
+                } else {
+                    field = find_schema_field(node, name, key.payload);
+                }
+                if (field < 0) {
+                    // Keys that aren't in the schema are skipped
+                    *pos = skip_msgpack(data, len, *pos);
+                    continue;
+                }
+                values[field] = decode_msgpack_schema(node->fields[field].type, data, len, pos, depth + 1);
+                expected = field + 1;
+            }
+            int32_t present = 0;
+            for (int32_t i = 0; i < node->field_count; i++) {
+                if (!janet_checktype(values[i], JANET_NIL)) {
+                    present++;
+                } else if (node->fields[i].type->kind != MSGPACK_SCHEMA_ANY) {
+                    janet_panicf("Missing field %v", node->fields[i].key);
+                }
+            }
+            JanetKV *st = janet_struct_begin(present);
+            for (int32_t i = 0; i < node->field_count; i++) {
+                if (!janet_checktype(values[i], JANET_NIL)) janet_struct_put(st, node->fields[i].key, values[i]);
+            }
+            janet_sfree(values);
+            return janet_wrap_struct(janet_struct_end(st));
+        }
+        case MSGPACK_SCHEMA_ANY:
+            break;
+    }
+    janet_panicf("Expected %s for schema, but got msgpack %s",
+        MSGPACK_SCHEMA_KIND_NAMES[node->kind], mpack_type_to_string(header.type));
+}
+
+static Janet cfun_schema_decode(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    struct msgpack_schema *schema = janet_getabstract(argv, 0, &msgpack_schema_type);
+    const uint8_t *data;
+    size_t len;
+    msgpack_bytes_view(argv[1], &data, &len);
+    size_t pos = 0;
+    return decode_msgpack_schema(schema->root, data, len, &pos, 0);
+}
+
+static const JanetMethod schema_methods[] = {
+    {"encode", cfun_schema_encode},
+    {"decode", cfun_schema_decode},
+    {NULL, NULL}
+};
+static int schema_get(void *p, Janet key, Janet *out) {
+    (void) p;
+    if (!janet_checktype(key, JANET_KEYWORD)) return 0;
+    return janet_getmethod(janet_unwrap_keyword(key), schema_methods, out);
+}
+
+static Janet janet_msgpack_compile_schema(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    struct msgpack_schema *schema = janet_abstract(&msgpack_schema_type, sizeof(struct msgpack_schema));
+    schema->root = NULL;
+    compile_schema_node(argv[0], &schema->root, 0);
+    return janet_wrap_abstract(schema);
+}
+
+/********/
+/* Tape */
+/********/
+
+/*
+ * A structural index over a message, inspired by simdjson's tape.
+ *
+ * Stage one records every object in a flat native array, where each container
+ * knows the index just past its subtree. Stage two materialises Janet values
+ * from any entry, so unwanted subtrees can be skipped in O(1).
+ *
+ * Building a tape does not touch the Janet VM (only janet_malloc), so it is
+ * safe to do on another thread.
+ */
+
+struct msgpack_tape_entry {
+    // Offset of the object's header in the input
+    size_t offset;
+    // Scalar value, if this is a bool/int/uint/float/double
+    union msgpack_scalar value;
+    // Payload bytes of a str/bin/ext, or element count of an array/map
+    uint32_t length;
+    // Tape index just past this object's subtree
+    uint32_t next;
+    uint8_t type;
+    int8_t exttype;
+    uint8_t header_len;
+};
+
+struct msgpack_tape {
+    const uint8_t *data;
+    size_t len;
+    // Offset just past the last object on the tape
+    size_t end;
+    struct msgpack_tape_entry *entries;
+    uint32_t count;
+    uint32_t capacity;
+};
+
+static void tape_init(struct msgpack_tape *tape, const uint8_t *data, size_t len) {
+    tape->data = data;
+    tape->len = len;
+    tape->end = 0;
+    tape->entries = NULL;
+    tape->count = 0;
+    tape->capacity = 0;
+}
+static void tape_deinit(struct msgpack_tape *tape) {
+    janet_free(tape->entries);
+    tape->entries = NULL;
+    tape->count = tape->capacity = 0;
+}
+
+/**
+ * Append the object starting at `pos` (and its whole subtree) to the tape.
+ *
+ * Returns NULL on success, or a static error message.
+ */
+static const char *tape_append_object(struct msgpack_tape *tape, size_t pos, bool check_utf8) {
+    const uint8_t *data = tape->data;
+    size_t len = tape->len;
+    uint64_t remaining[MSGPACK_SCAN_MAX_DEPTH + 1];
+    uint32_t containers[MSGPACK_SCAN_MAX_DEPTH + 1];
+    int32_t depth = 0;
+    remaining[0] = 1;
+    while (true) {
+        while (remaining[depth] == 0) {
+            if (depth == 0) {
+                tape->end = pos;
+                return NULL;
+            }
+            tape->entries[containers[depth]].next = tape->count;
+            depth -= 1;
+        }
+        remaining[depth] -= 1;
+        struct msgpack_header header;
+        if (!read_msgpack_header(data, len, pos, &header)) {
+            return pos >= len ? "unexpected end of msgpack input" : "invalid msgpack type byte";
+        }
+        if (tape->count == tape->capacity) {
+            if (tape->capacity >= UINT32_MAX / 2) return "msgpack tape too large";
+            uint32_t capacity = tape->capacity < 16 ? 16 : tape->capacity * 2;
+            struct msgpack_tape_entry *entries = janet_realloc(tape->entries, capacity * sizeof(struct msgpack_tape_entry));
+            if (entries == NULL) return "out of memory building msgpack tape";
+            tape->entries = entries;
+            tape->capacity = capacity;
+        }
+        uint32_t index = tape->count++;
+        struct msgpack_tape_entry *entry = &tape->entries[index];
+        entry->offset = pos;
+        entry->next = index + 1;
+        entry->type = (uint8_t) header.type;
+        entry->exttype = header.exttype;
+        entry->header_len = header.header_len;
+        entry->value.u = 0;
+        const uint8_t *start = data + pos;
+        pos += header.header_len;
+        switch (header.type) {
+            case mpack_type_array:
+            case mpack_type_map: {
+                entry->length = header.count;
+                if (header.count == 0) break;
+                uint64_t items = header.type == mpack_type_map ? 2 * (uint64_t) header.count : header.count;
+                if (items > len - pos) return "msgpack container is longer than the input";
+                if (depth >= MSGPACK_SCAN_MAX_DEPTH) return "msgpack nested too deeply";
+                depth += 1;
+                remaining[depth] = items;
+                containers[depth] = index;
+                break;
+            }
+            default:
+                if (header.payload > len - pos) return "unexpected end of msgpack input";
+                if (check_utf8 && header.type == mpack_type_str && !msgpack_utf8_valid(data + pos, header.payload)) {
+                    return "invalid UTF-8 in msgpack string";
+                }
+                entry->length = header.payload;
+                read_msgpack_scalar(start, &header, &entry->value);
+                pos += header.payload;
+                break;
+        }
+    }
+}
+
+/**
+ * Wrap the bytes of the value at *index as a raw value, skipping past it.
+ */
+static Janet tape_decode_raw(const struct msgpack_tape *tape, uint32_t *index) {
+    const struct msgpack_tape_entry *raw = &tape->entries[*index];
+    size_t end = raw->next < tape->count ? tape->entries[raw->next].offset : tape->end;
+    *index = raw->next;
+    return wrap_raw(tape->data + raw->offset, end - raw->offset);
+}
+/**
+ * Materialise the value at tape->entries[*index], advancing the index past its subtree.
+ */
+static Janet tape_decode(struct janet_msgpack_decoder *decoder, const struct msgpack_tape *tape, uint32_t *index, int depth) {
+    account_decoded_depth(decoder, depth);
+    const struct msgpack_tape_entry *entry = &tape->entries[*index];
+    *index += 1;
+    switch ((mpack_type_t) entry->type) {
+        case mpack_type_nil:
+            return janet_wrap_nil();
+        case mpack_type_bool:
+            return janet_wrap_boolean(entry->value.b);
+        case mpack_type_int:
+            return wrap_decoded_int(entry->value.i);
+        case mpack_type_uint:
+            return wrap_decoded_uint(entry->value.u);
+        case mpack_type_float:
+        case mpack_type_double:
+            return janet_wrap_number(entry->value.d);
+        case mpack_type_str:
+        case mpack_type_bin: {
+            enum msgpack_string_type string_type = entry->type == mpack_type_str ? MSGPACK_STRING_STRING : MSGPACK_BYTES_STRING;
+            account_decoded_string(decoder, entry->length);
+            return wrap_decoded_string(
+                decoded_string_type(decoder, string_type),
+                (const char*) tape->data + entry->offset + entry->header_len,
+                entry->length
+            );
+        }
+        case mpack_type_array: {
+            // The tape already holds an entry for every element, so there's no claim to check
+            int32_t len = (int32_t) entry->length;
+            account_decoded_elements(decoder, len, (size_t) len * sizeof(Janet));
+            if (decoder->array_type == JANET_TYPE_MUTABLE) {
+                JanetArray *array = janet_array(len);
+                if (decoder->shared) share_decoded(decoder, entry->offset, janet_wrap_array(array));
+                for (int32_t i = 0; i < len; i++) {
+                    array->data[i] = tape_decode(decoder, tape, index, depth + 1);
+                }
+                array->count = len;
+                return janet_wrap_array(array);
+            } else {
+                Janet *data = janet_tuple_begin(len);
+                if (decoder->shared) share_decoded(decoder, entry->offset, janet_wrap_false());
+                for (int32_t i = 0; i < len; i++) {
+                    data[i] = tape_decode(decoder, tape, index, depth + 1);
+                }
+                Janet tuple = janet_wrap_tuple(janet_tuple_end(data));
+                if (decoder->shared) share_decoded(decoder, entry->offset, tuple);
+                return tuple;
+            }
+        }
+        case mpack_type_map: {
+            int32_t len = (int32_t) entry->length;
+            JanetTable *only = decoder->only;
+            JanetTable *raw_paths = decoder->raw_paths;
+            int32_t kept = only != NULL && only->count < len ? only->count : len;
+            account_decoded_elements(decoder, kept, (size_t) kept * 2 * sizeof(JanetKV));
+            JanetTable *table = NULL;
+            JanetKV *st = NULL;
+            if (decoder->map_type == JANET_TYPE_MUTABLE || only != NULL) {
+                table = janet_table(kept);
+            } else {
+                st = janet_struct_begin(len);
+            }
+            if (decoder->shared) {
+                share_decoded(decoder, entry->offset, decoder->map_type == JANET_TYPE_MUTABLE ? janet_wrap_table(table) : janet_wrap_false());
+            }
+            for (int32_t i = 0; i < len; i++) {
+                JanetType old_string_type = decoder->string_type;
+                decoder->string_type = JANET_KEYWORD;
+                Janet key = tape_decode(decoder, tape, index, depth + 1);
+                decoder->string_type = old_string_type;
+                if (only != NULL && !enter_projection(decoder, only, key)) {
+                    *index = tape->entries[*index].next;
+                    continue;
+                }
+                Janet value;
+                if (enter_raw_paths(decoder, raw_paths, key)) {
+                    value = tape_decode_raw(tape, index);
+                } else {
+                    value = tape_decode(decoder, tape, index, depth + 1);
+                }
+                decoder->only = only;
+                decoder->raw_paths = raw_paths;
+                if (table != NULL) {
+                    janet_table_put(table, key, value);
+                } else {
+                    janet_struct_put(st, key, value);
+                }
+            }
+            if (decoder->map_type == JANET_TYPE_MUTABLE) return janet_wrap_table(table);
+            Janet result = st != NULL
+                ? janet_wrap_struct(janet_struct_end(st))
+                : janet_wrap_struct(janet_table_to_struct(table));
+            if (decoder->shared) share_decoded(decoder, entry->offset, result);
+            return result;
+        }
+        case mpack_type_ext:
+            return decode_msgpack_ext(decoder, entry->exttype, tape->data + entry->offset + entry->header_len, entry->length, depth);
+        default:
+            janet_panicf("Unsupported msgpack type: %s", mpack_type_to_string((mpack_type_t) entry->type));
+    }
+}
+
+struct msgpack_tape_object {
+    struct msgpack_tape tape;
+    // Keeps the tape's input alive
+    Janet source;
+};
+
+static int tape_gc(void *p, size_t len) {
+    (void) len;
+    tape_deinit(&((struct msgpack_tape_object*) p)->tape);
+    return 0;
+}
+static int tape_gcmark(void *p, size_t len) {
+    (void) len;
+    janet_mark(((struct msgpack_tape_object*) p)->source);
+    return 0;
+}
+static int tape_get(void *p, Janet key, Janet *out);
+static const JanetAbstractType msgpack_tape_type = {
+    "msgpack/tape",
+    tape_gc,
+    tape_gcmark,
+    tape_get,
+    JANET_ATEND_GET
+};
+
+static const struct enum_entry MSGPACK_TYPE_NAMES[] = {
+    {"nil", mpack_type_nil},
+    {"bool", mpack_type_bool},
+    {"int", mpack_type_int},
+    {"uint", mpack_type_uint},
+    {"float", mpack_type_float},
+    {"double", mpack_type_double},
+    {"str", mpack_type_str},
+    {"bin", mpack_type_bin},
+    {"array", mpack_type_array},
+    {"map", mpack_type_map},
+    {"ext", mpack_type_ext},
+    {NULL, 0}
+};
+
+static const struct msgpack_tape_entry *tape_getentry(const struct msgpack_tape *tape, const Janet *argv, int32_t n) {
+    int32_t index = janet_getnat(argv, n);
+    if ((uint32_t) index >= tape->count) {
+        janet_panicf("Tape index %d out of range [0, %d)", index, (int32_t) tape->count);
+    }
+    return &tape->entries[index];
+}
+
+static Janet cfun_tape_length(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    struct msgpack_tape_object *object = janet_getabstract(argv, 0, &msgpack_tape_type);
+    return janet_wrap_number((double) object->tape.count);
+}
+static Janet cfun_tape_type(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    struct msgpack_tape_object *object = janet_getabstract(argv, 0, &msgpack_tape_type);
+    const struct msgpack_tape_entry *entry = tape_getentry(&object->tape, argv, 1);
+    for (const struct enum_entry *name = MSGPACK_TYPE_NAMES; name->name != NULL; name++) {
+        if (name->value == entry->type) return janet_ckeywordv(name->name);
+    }
+    return janet_wrap_nil();
+}
+static Janet cfun_tape_count(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    struct msgpack_tape_object *object = janet_getabstract(argv, 0, &msgpack_tape_type);
+    return janet_wrap_number((double) tape_getentry(&object->tape, argv, 1)->length);
+}
+static Janet cfun_tape_next(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    struct msgpack_tape_object *object = janet_getabstract(argv, 0, &msgpack_tape_type);
+    return janet_wrap_number((double) tape_getentry(&object->tape, argv, 1)->next);
+}
+static Janet cfun_tape_extent(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    struct msgpack_tape_object *object = janet_getabstract(argv, 0, &msgpack_tape_type);
+    const struct msgpack_tape *tape = &object->tape;
+    const struct msgpack_tape_entry *entry = tape_getentry(tape, argv, 1);
+    size_t end = entry->next < tape->count ? tape->entries[entry->next].offset : tape->end;
+    Janet extent[2] = {janet_wrap_number((double) entry->offset), janet_wrap_number((double) end)};
+    return janet_wrap_tuple(janet_tuple_n(extent, 2));
+}
+static Janet cfun_tape_child(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 3);
+    struct msgpack_tape_object *object = janet_getabstract(argv, 0, &msgpack_tape_type);
+    const struct msgpack_tape *tape = &object->tape;
+    const struct msgpack_tape_entry *entry = tape_getentry(tape, argv, 1);
+    int32_t n = janet_getnat(argv, 2);
+    uint64_t children = entry->type == mpack_type_map ? 2 * (uint64_t) entry->length : entry->length;
+    if (entry->type != mpack_type_array && entry->type != mpack_type_map) {
+        janet_panic("Expected an array or map entry");
+    }
+    if ((uint64_t) n >= children) return janet_wrap_nil();
+    uint32_t index = (uint32_t) (entry - tape->entries) + 1;
+    while (n-- > 0) index = tape->entries[index].next;
+    return janet_wrap_number((double) index);
+}
+static Janet cfun_tape_lookup(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 3);
+    struct msgpack_tape_object *object = janet_getabstract(argv, 0, &msgpack_tape_type);
+    const struct msgpack_tape *tape = &object->tape;
+    const struct msgpack_tape_entry *entry = tape_getentry(tape, argv, 1);
+    if (entry->type != mpack_type_map) janet_panic("Expected a map entry");
+    const uint8_t *key;
+    int32_t key_len;
+    if (!janet_bytes_view(argv[2], &key, &key_len)) {
+        janet_panicf("Expected a string or keyword key, but got %t", argv[2]);
+    }
+    uint32_t index = (uint32_t) (entry - tape->entries) + 1;
+    for (uint32_t i = 0; i < entry->length; i++) {
+        const struct msgpack_tape_entry *k = &tape->entries[index];
+        if (k->type == mpack_type_str && k->length == (uint32_t) key_len &&
+                memcmp(tape->data + k->offset + k->header_len, key, key_len) == 0) {
+            return janet_wrap_number((double) k->next);
+        }
+        index = tape->entries[k->next].next;
+    }
+    return janet_wrap_nil();
+}
+static Janet cfun_tape_decode(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 3);
+    struct msgpack_tape_object *object = janet_getabstract(argv, 0, &msgpack_tape_type);
+    uint32_t index = 0;
+    if (argc > 1) index = (uint32_t) (tape_getentry(&object->tape, argv, 1) - object->tape.entries);
+    struct janet_msgpack_decoder decoder = {
+        .reader = NULL,
+        .string_type = JANET_STRING,
+        .bin_type = JANET_TYPE_MUTABLE,
+        .array_type = JANET_TYPE_MUTABLE,
+        .map_type = JANET_TYPE_MUTABLE
+    };
+    if (argc > 2) parse_decoded_types(&decoder, argv[2]);
+    parse_decode_options(&decoder, janet_wrap_nil());
+    if (object->tape.count == 0) janet_panic("Tape is empty");
+    return tape_decode(&decoder, &object->tape, &index, 0);
+}
+
+static const JanetMethod tape_methods[] = {
+    {"length", cfun_tape_length},
+    {"type", cfun_tape_type},
+    {"count", cfun_tape_count},
+    {"next", cfun_tape_next},
+    {"extent", cfun_tape_extent},
+    {"child", cfun_tape_child},
+    {"lookup", cfun_tape_lookup},
+    {"decode", cfun_tape_decode},
+    {NULL, NULL}
+};
+static int tape_get(void *p, Janet key, Janet *out) {
+    (void) p;
+    if (!janet_checktype(key, JANET_KEYWORD)) return 0;
+    return janet_getmethod(janet_unwrap_keyword(key), tape_methods, out);
+}
+
+static Janet janet_msgpack_tape(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 2);
+    const uint8_t *data;
+    size_t len;
+    msgpack_bytes_view(argv[0], &data, &len);
+    Janet options = argc > 1 ? argv[1] : janet_wrap_nil();
+    int64_t start = get_limit_option(options, "start", 0);
+    Janet utf8_option = get_option(options, "utf8");
+    bool check_utf8 = janet_checktype(utf8_option, JANET_NIL) || janet_truthy(utf8_option);
+    if ((uint64_t) start > len) janet_panicf("Start offset %d is past the end of the input", (int32_t) start);
+    struct msgpack_tape_object *object = janet_abstract(&msgpack_tape_type, sizeof(struct msgpack_tape_object));
+    // Buffers may be mutated (or reallocated) underneath us, so the tape keeps its own copy
+    if (janet_checktype(argv[0], JANET_BUFFER)) {
+        data = janet_string(data, (int32_t) len);
+        object->source = janet_wrap_string(data);
+    } else {
+        object->source = argv[0];
+    }
+    tape_init(&object->tape, data, len);
+    const char *error = tape_append_object(&object->tape, (size_t) start, check_utf8);
+    if (error != NULL) janet_panicf("Error building msgpack tape: %s", error);
+    return janet_wrap_abstract(object);
+}
+
+/***********/
+/* Threads */
+/***********/
+
+/*
+ * Worker threads never touch the Janet VM they were spawned from.
+ * They only see plain native memory, and the calling thread blocks until
+ * every worker has been joined.
+ */
+
+#define MSGPACK_MAX_THREADS 64
+
+typedef void (*msgpack_work_fn)(void *arg, bool on_caller);
+struct msgpack_work {
+    msgpack_work_fn fn;
+    void *arg;
+};
+#ifdef _WIN32
+static DWORD WINAPI msgpack_thread_main(LPVOID p) {
+    struct msgpack_work *work = p;
+    work->fn(work->arg, false);
+    return 0;
+}
+#else
+static void *msgpack_thread_main(void *p) {
+    struct msgpack_work *work = p;
+    work->fn(work->arg, false);
+    return NULL;
+}
+#endif
+
+static int32_t default_thread_count(void) {
+    #ifdef _WIN32
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        long count = (long) info.dwNumberOfProcessors;
+    #else
+        long count = sysconf(_SC_NPROCESSORS_ONLN);
+    #endif
+    if (count < 1) return 1;
+    return count > MSGPACK_MAX_THREADS ? MSGPACK_MAX_THREADS : (int32_t) count;
+}
+static int32_t get_thread_option(Janet options) {
+    int64_t threads = get_limit_option(options, "threads", 0);
+    if (threads == 0) return default_thread_count();
+    return threads > MSGPACK_MAX_THREADS ? MSGPACK_MAX_THREADS : (int32_t) threads;
+}
+
+/**
+ * Run fn over each of the `count` work items (each `size` bytes apart), one per thread.
+ *
+ * The first item runs on the calling thread. If a thread can't be started,
+ * its item runs on the calling thread as well.
+ */
+static void run_parallel(msgpack_work_fn fn, void *items, size_t size, int32_t count) {
+    struct msgpack_work work[MSGPACK_MAX_THREADS];
+    #ifdef _WIN32
+        HANDLE threads[MSGPACK_MAX_THREADS];
+    #else
+        pthread_t threads[MSGPACK_MAX_THREADS];
+    #endif
+    bool started[MSGPACK_MAX_THREADS];
+    assert(count <= MSGPACK_MAX_THREADS);
+    for (int32_t i = 1; i < count; i++) {
+        work[i].fn = fn;
+        work[i].arg = (char*) items + i * size;
+        #ifdef _WIN32
+            threads[i] = CreateThread(NULL, 0, msgpack_thread_main, &work[i], 0, NULL);
+            started[i] = threads[i] != NULL;
+        #else
+            started[i] = pthread_create(&threads[i], NULL, msgpack_thread_main, &work[i]) == 0;
+        #endif
+        if (!started[i]) fn(work[i].arg, true);
+    }
+    if (count > 0) fn(items, true);
+    for (int32_t i = 1; i < count; i++) {
+        if (!started[i]) continue;
+        #ifdef _WIN32
+            WaitForSingleObject(threads[i], INFINITE);
+            CloseHandle(threads[i]);
+        #else
+            pthread_join(threads[i], NULL);
+        #endif
+    }
+}
+
+/*******************/
+/* Parallel Decode */
+/*******************/
+
+struct decode_worker {
+    struct msgpack_tape tape;
+    // Byte range of the top-level elements this worker is responsible for
+    size_t start;
+    size_t end;
+    const char *error;
+};
+
+static void decode_worker_run(void *arg, bool on_caller) {
+    (void) on_caller;
+    struct decode_worker *worker = arg;
+    size_t pos = worker->start;
+    while (pos < worker->end) {
+        worker->error = tape_append_object(&worker->tape, pos, true);
+        if (worker->error != NULL) return;
+        pos = worker->tape.end;
+    }
+}
+
+static Janet janet_msgpack_decode_parallel(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 3);
+    const uint8_t *data;
+    size_t len;
+    msgpack_bytes_view(argv[0], &data, &len);
+    Janet options = argc > 2 ? argv[2] : janet_wrap_nil();
+    struct msgpack_header header;
+    if (!read_msgpack_header(data, len, 0, &header)) {
+        janet_panic("Error decoding msgpack: invalid or truncated header");
+    }
+    if (header.type != mpack_type_array && header.type != mpack_type_map) {
+        // Scalars, strings & exts have nothing to split up
+        return decode_msgpack_data(data, len, argc > 1 ? argv[1] : janet_wrap_nil(), options);
+    }
+    struct janet_msgpack_decoder decoder = {
+        .reader = NULL,
+        .message = data,
+        .message_len = len,
+        .string_type = JANET_STRING,
+        .bin_type = JANET_TYPE_MUTABLE,
+        .array_type = JANET_TYPE_MUTABLE,
+        .map_type = JANET_TYPE_MUTABLE
+    };
+    if (argc > 1) parse_decoded_types(&decoder, argv[1]);
+    parse_decode_options(&decoder, options);
+    int32_t thread_count = get_thread_option(options);
+    bool is_map = header.type == mpack_type_map;
+    if (header.count < (uint32_t) thread_count * 2) {
+        // Not worth splitting up
+        thread_count = 1;
+    }
+    int32_t count = check_length_cast(header.count);
+    uint64_t children = is_map ? 2 * (uint64_t) header.count : header.count;
+    if (children > len - header.header_len) {
+        janet_panic("Error decoding msgpack: container is longer than the input");
+    }
+    /*
+     * Structural pre-scan: skip over the top-level elements to split them into
+     * byte ranges of roughly equal size. Map entries are never split in half.
+     */
+    if (children > 0 && decoder.limits.max_depth < 1) {
+        janet_panicf("Exceeded decode limit of %d nesting levels", decoder.limits.max_depth);
+    }
+    struct decode_worker workers[MSGPACK_MAX_THREADS];
+    // Checked early against :max-elements, then counted again while assembling
+    int64_t elements = count;
+    size_t pos = header.header_len;
+    size_t body = len - pos;
+    int32_t worker_count = 0;
+    workers[0].start = pos;
+    for (uint64_t i = 0; i < children; i++) {
+        if (worker_count + 1 < thread_count && (!is_map || i % 2 == 0)) {
+            size_t target = header.header_len + body / thread_count * (worker_count + 1);
+            if (pos >= target) {
+                workers[worker_count].end = pos;
+                worker_count += 1;
+                workers[worker_count].start = pos;
+            }
+        }
+        struct msgpack_scan_result result;
+        const char *error = scan_msgpack(data, len, pos, false, decoder.limits.max_depth - 1, &result);
+        if (error != NULL) janet_panicf("Error decoding msgpack: %s", error);
+        elements += result.elements;
+        pos = result.end;
+    }
+    if (decoder.limits.max_elements >= 0 && elements > decoder.limits.max_elements) {
+        janet_panicf("Exceeded decode limit of %v total elements", janet_wrap_number((double) decoder.limits.max_elements));
+    }
+    workers[worker_count].end = pos;
+    worker_count += 1;
+    for (int32_t i = 0; i < worker_count; i++) {
+        tape_init(&workers[i].tape, data, len);
+        workers[i].error = NULL;
+    }
+    run_parallel(decode_worker_run, workers, sizeof(struct decode_worker), worker_count);
+    for (int32_t i = 0; i < worker_count; i++) {
+        if (workers[i].error != NULL) {
+            const char *error = workers[i].error;
+            for (int32_t j = 0; j < worker_count; j++) tape_deinit(&workers[j].tape);
+            janet_panicf("Error decoding msgpack: %s", error);
+        }
+    }
+    /*
+     * Assemble the final value on the calling thread, since that's the only
+     * place Janet values can be created.
+     */
+    JanetArray *array = NULL;
+    Janet *tuple = NULL;
+    JanetTable *table = NULL;
+    JanetKV *st = NULL;
+    JanetTryState state;
+    JanetSignal signal = janet_try(&state);
+    if (signal != JANET_SIGNAL_OK) {
+        janet_restore(&state);
+        for (int32_t i = 0; i < worker_count; i++) tape_deinit(&workers[i].tape);
+        janet_panicv(state.payload);
+    }
+    if (is_map) {
+        account_decoded_elements(&decoder, count, (size_t) count * 2 * sizeof(JanetKV));
+        if (decoder.map_type == JANET_TYPE_MUTABLE || decoder.only != NULL) table = janet_table(count);
+        else st = janet_struct_begin(count);
+    } else {
+        account_decoded_elements(&decoder, count, (size_t) count * sizeof(Janet));
+        if (decoder.array_type == JANET_TYPE_MUTABLE) array = janet_array(count);
+        else tuple = janet_tuple_begin(count);
+    }
+    if (decoder.shared) {
+        Janet root = janet_wrap_false();
+        if (table != NULL && decoder.map_type == JANET_TYPE_MUTABLE) root = janet_wrap_table(table);
+        if (array != NULL) root = janet_wrap_array(array);
+        share_decoded(&decoder, 0, root);
+    }
+    int32_t item = 0;
+    for (int32_t i = 0; i < worker_count; i++) {
+        uint32_t index = 0;
+        const struct msgpack_tape *tape = &workers[i].tape;
+        while (index < tape->count) {
+            if (is_map) {
+                JanetType old_string_type = decoder.string_type;
+                decoder.string_type = JANET_KEYWORD;
+                Janet key = tape_decode(&decoder, tape, &index, 1);
+                decoder.string_type = old_string_type;
+                JanetTable *only = decoder.only;
+                JanetTable *raw_paths = decoder.raw_paths;
+                if (only != NULL && !enter_projection(&decoder, only, key)) {
+                    index = tape->entries[index].next;
+                    continue;
+                }
+                Janet value = enter_raw_paths(&decoder, raw_paths, key)
+                    ? tape_decode_raw(tape, &index)
+                    : tape_decode(&decoder, tape, &index, 1);
+                decoder.only = only;
+                decoder.raw_paths = raw_paths;
+                if (table != NULL) janet_table_put(table, key, value);
+                else janet_struct_put(st, key, value);
+            } else {
+                Janet value = tape_decode(&decoder, tape, &index, 1);
+                if (array != NULL) janet_array_push(array, value);
+                else tuple[item] = value;
+            }
+            item += 1;
+        }
+    }
+    janet_restore(&state);
+    for (int32_t i = 0; i < worker_count; i++) tape_deinit(&workers[i].tape);
+    report_decode_stats(&decoder, options);
+    if (table != NULL && decoder.map_type != JANET_TYPE_MUTABLE) return janet_wrap_struct(janet_table_to_struct(table));
+    if (table != NULL) return janet_wrap_table(table);
+    if (st != NULL) return janet_wrap_struct(janet_struct_end(st));
+    if (array != NULL) return janet_wrap_array(array);
+    return janet_wrap_tuple(janet_tuple_end(tuple));
+}
+
+/*******************/
+/* Parallel Encode */
+/*******************/
+
+/*
+ * Workers encode a slice of the top-level array/table into their own native
+ * buffer, reading the Janet values as a read-only snapshot. This is safe
+ * because the calling thread is blocked until they finish, so nothing can
+ * mutate or collect the values in the meantime.
+ *
+ * Each worker thread runs its own (empty) Janet VM, so that the encoder can
+ * panic and grow buffers exactly as it does on the calling thread.
+ */
+
+struct encode_worker {
+    struct msgpack_encoder encoder;
+    JanetBuffer buffer;
+    // Slice of an array/tuple
+    const Janet *items;
+    int32_t count;
+    // Slice of the slots of a table/struct
+    const JanetKV *kvs;
+    int32_t capacity;
+    // With :canonical, a slice of the sorted slots of kvs instead
+    const int32_t *order;
+    // Error message, allocated with janet_malloc
+    char *error;
+};
+
+static void encode_worker_run(void *arg, bool on_caller) {
+    struct encode_worker *worker = arg;
+    if (!on_caller) janet_init();
+    janet_buffer_init(&worker->buffer, 64);
+    worker->encoder.buffer = &worker->buffer;
+    JanetTryState state;
+    if (!janet_try(&state)) {
+        for (int32_t i = 0; i < worker->count; i++) {
+            encode_msgpack(&worker->encoder, worker->items[i], 1);
+        }
+        for (int32_t i = 0; i < worker->capacity; i++) {
+            const JanetKV *kv = &worker->kvs[worker->order != NULL ? worker->order[i] : i];
+            if (janet_checktype(kv->key, JANET_NIL)) continue;
+            encode_msgpack(&worker->encoder, kv->key, 1);
+            encode_msgpack(&worker->encoder, kv->value, 1);
+        }
+    } else {
+        // The message belongs to this thread's VM, so copy it out before that goes away
+        const uint8_t *message;
+        int32_t len;
+        if (!janet_bytes_view(state.payload, &message, &len)) {
+            message = (const uint8_t*) "error in encoding worker";
+            len = (int32_t) strlen((const char*) message);
+        }
+        worker->error = janet_malloc((size_t) len + 1);
+        if (worker->error != NULL) {
+            memcpy(worker->error, message, len);
+            worker->error[len] = '\0';
+        }
+    }
+    janet_restore(&state);
+    if (!on_caller) janet_deinit();
+}
+
+static Janet janet_msgpack_encode_parallel(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 4);
+    JanetBuffer *buffer = janet_optbuffer(argv, argc, 2, 32);
+    struct msgpack_encoder encoder = {
+        .buffer = buffer,
+        .string_type = MSGPACK_STRING_STRING,
+        .buffer_type = MSGPACK_BYTES_STRING,
+    };
+    if (argc > 1) parse_encoded_types(&encoder, argv[1]);
+    Janet options = argc > 3 ? argv[3] : janet_wrap_nil();
+    parse_encode_options(&encoder, options);
+    // Back-references & shared containers are offsets into the whole message, which no worker sees
+    if (encoder.dedupe != NULL) janet_panic("encode-parallel doesn't support :dedupe");
+    if (encoder.shared != NULL) janet_panic("encode-parallel doesn't support :shared");
+    int32_t thread_count = get_thread_option(options);
+    Janet value = argv[0];
+    const Janet *items = NULL;
+    const JanetKV *kvs = NULL;
+    int32_t len = 0, capacity = 0;
+    if (janet_indexed_view(value, &items, &len)) {
+        capacity = len;
+    } else if (!janet_dictionary_view(value, &kvs, &len, &capacity)) {
+        items = NULL;
+        kvs = NULL;
+    }
+    bool columnar = encoder.columnar && items != NULL && is_uniform_records(items, len);
+    if ((items == NULL && kvs == NULL) || capacity < thread_count * 16 || columnar) {
+        // Too small to be worth starting threads (or a single columnar ext)
+        encode_msgpack(&encoder, value, 0);
+        return janet_wrap_buffer(buffer);
+    }
+    // Sort on the calling thread, so the workers only need to split the sorted slots
+    int32_t *order = kvs != NULL && encoder.canonical ? sort_map_keys(&encoder, kvs, len, capacity) : NULL;
+    int32_t slots = order != NULL ? len : capacity;
+    int32_t start = buffer->count;
+    if (items != NULL) {
+        encode_msgpack_collection_length(&encoder, len, 0x90, 0xDC);
+    } else {
+        encode_msgpack_collection_length(&encoder, len, 0x80, 0xDE);
+    }
+    struct encode_worker workers[MSGPACK_MAX_THREADS];
+    int32_t chunk = slots / thread_count;
+    for (int32_t i = 0; i < thread_count; i++) {
+        struct encode_worker *worker = &workers[i];
+        int32_t start = i * chunk;
+        int32_t end = i == thread_count - 1 ? slots : start + chunk;
+        worker->encoder = encoder;
+        worker->encoder.on_worker = true;
+        worker->error = NULL;
+        worker->items = NULL;
+        worker->kvs = NULL;
+        worker->order = NULL;
+        worker->count = worker->capacity = 0;
+        if (items != NULL) {
+            worker->items = items + start;
+            worker->count = end - start;
+        } else if (order != NULL) {
+            worker->kvs = kvs;
+            worker->order = order + start;
+            worker->capacity = end - start;
+        } else {
+            worker->kvs = kvs + start;
+            worker->capacity = end - start;
+        }
+    }
+    run_parallel(encode_worker_run, workers, sizeof(struct encode_worker), thread_count);
+    if (order != NULL) janet_sfree(order);
+    char *error = NULL;
+    for (int32_t i = 0; i < thread_count; i++) {
+        if (workers[i].error != NULL && error == NULL) {
+            error = workers[i].error;
+        } else if (error == NULL) {
+            janet_buffer_push_bytes(buffer, workers[i].buffer.data, workers[i].buffer.count);
+        } else {
+            janet_free(workers[i].error);
+        }
+        janet_buffer_deinit(&workers[i].buffer);
+    }
+    if (error != NULL) {
+        // Drop the header and any chunks already appended
+        buffer->count = start;
+        const uint8_t *message = janet_cstring(error);
+        janet_free(error);
+        janet_panicv(janet_wrap_string(message));
+    }
+    return janet_wrap_buffer(buffer);
+}
+
+/*********/
+/* Files */
+/*********/
+
+static Janet janet_msgpack_open_file(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    const char *path = janet_getcstring(argv, 0);
+    struct msgpack_mapping *mapping = janet_abstract(&msgpack_mapping_type, sizeof(struct msgpack_mapping));
+    mapping->data = NULL;
+    mapping->len = 0;
+    map_file(mapping, path);
+    return janet_wrap_abstract(mapping);
+}
+
+static Janet janet_msgpack_decode_file(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 3);
+    const char *path = janet_getcstring(argv, 0);
+    struct msgpack_mapping mapping;
+    map_file(&mapping, path);
+    #ifndef _WIN32
+        if (mapping.data != NULL) posix_madvise((void*) mapping.data, mapping.len, POSIX_MADV_SEQUENTIAL);
+    #endif
+    JanetTryState state;
+    if (janet_try(&state)) {
+        janet_restore(&state);
+        mapping_gc(&mapping, sizeof(mapping));
+        janet_panicv(state.payload);
+    }
+    Janet result = decode_msgpack_data(
+        mapping.data, mapping.len,
+        argc > 1 ? argv[1] : janet_wrap_nil(),
+        argc > 2 ? argv[2] : janet_wrap_nil()
+    );
+    janet_restore(&state);
+    mapping_gc(&mapping, sizeof(mapping));
+    return result;
+}
+
+/**************/
+/* Record Log */
+/**************/
+
+/*
+ * An append-only file of msgpack records, written in blocks:
+ *
+ *     block  := record* index footer
+ *     index  := [first-record block-start offsets keys]
+ *     footer := index length (4 bytes, big endian) "MPLG"
+ *
+ * The index is itself msgpack. `offsets` is a bin of 4-byte big endian offsets
+ * of each record relative to block-start, so record N is found in O(1) once
+ * its block is known. `keys` is either nil or an array holding one key per
+ * record. Keys must never decrease, so they can be binary searched.
+ *
+ * Blocks are found by walking the footers backwards from the end of the file.
+ * A write interrupted part way through a block leaves it without a valid footer,
+ * so everything after the last complete block is ignored (and truncated by the
+ * next writer). Damage anywhere before that makes the whole log corrupt.
+ *
+ * Keys are compared as they read back from msgpack: strings and keywords are
+ * both strings, and arrays & maps are tuples & structs, which compare by value.
+ */
+
+#define MSGPACK_LOG_MAGIC "MPLG"
+#define MSGPACK_LOG_FOOTER_LEN 8
+
+struct msgpack_log_block {
+    // Absolute offset of the first record (and of the block itself)
+    size_t start;
+    // Absolute offset of the index, which is also the end of the last record
+    size_t index;
+    // Absolute offset of the keys array, or zero if the block has no keys
+    size_t keys;
+    const uint8_t *offsets;
+    uint64_t first;
+    uint32_t count;
+};
+
+static bool read_log_uint(const uint8_t *data, size_t len, size_t *pos, uint64_t *out) {
+    struct msgpack_header header;
+    if (!read_msgpack_header(data, len, *pos, &header)) return false;
+    if (header.payload > len - *pos - header.header_len) return false;
+    union msgpack_scalar value;
+    read_msgpack_scalar(data + *pos, &header, &value);
+    if (header.type == mpack_type_uint) {
+        *out = value.u;
+    } else if (header.type == mpack_type_int && value.i >= 0) {
+        *out = (uint64_t) value.i;
+    } else {
+        return false;
+    }
+    *pos += header.header_len + header.payload;
+    return true;
+}
+
+/**
+ * Parse the block whose footer ends at `end`, returning false if it is corrupt.
+ */
+static bool parse_log_block(const uint8_t *data, size_t end, struct msgpack_log_block *block) {
+    if (end < MSGPACK_LOG_FOOTER_LEN) return false;
+    const uint8_t *footer = data + end - MSGPACK_LOG_FOOTER_LEN;
+    if (memcmp(footer + 4, MSGPACK_LOG_MAGIC, 4) != 0) return false;
+    size_t index_len = (size_t) read_bigendian(footer, 4);
+    size_t index_end = end - MSGPACK_LOG_FOOTER_LEN;
+    if (index_len > index_end) return false;
+    size_t pos = block->index = index_end - index_len;
+    struct msgpack_header header;
+    if (!read_msgpack_header(data, index_end, pos, &header) || header.type != mpack_type_array || header.count != 4) {
+        return false;
+    }
+    pos += header.header_len;
+    uint64_t start;
+    if (!read_log_uint(data, index_end, &pos, &block->first)) return false;
+    if (!read_log_uint(data, index_end, &pos, &start) || start > block->index) return false;
+    block->start = (size_t) start;
+    if (!read_msgpack_header(data, index_end, pos, &header) || header.type != mpack_type_bin) return false;
+    if (header.payload % 4 != 0 || header.payload > index_end - pos - header.header_len) return false;
+    block->count = header.payload / 4;
+    block->offsets = data + pos + header.header_len;
+    pos += header.header_len + header.payload;
+    if (!read_msgpack_header(data, index_end, pos, &header)) return false;
+    if (header.type == mpack_type_nil) {
+        block->keys = 0;
+    } else if (header.type == mpack_type_array && header.count == block->count && block->count > 0) {
+        // :find reads the first key of every block
+        block->keys = pos;
+    } else {
+        return false;
+    }
+    // Records can't overlap, or their extents would underflow
+    uint64_t previous = 0;
+    for (uint32_t i = 0; i < block->count; i++) {
+        uint64_t offset = read_bigendian(block->offsets + 4 * i, 4);
+        if (offset < previous || offset > block->index - block->start) return false;
+        previous = offset;
+    }
+    return true;
+}
+
+struct msgpack_log {
+    struct msgpack_mapping mapping;
+    struct msgpack_log_block *blocks;
+    uint32_t block_count;
+    uint64_t record_count;
+    // End of the last complete block
+    size_t end;
+    // The decoded keys of each block, filled in lazily
+    JanetArray *keys;
+};
+
+static int log_gc(void *p, size_t len) {
+    struct msgpack_log *log = p;
+    janet_free(log->blocks);
+    log->blocks = NULL;
+    return mapping_gc(&log->mapping, len);
+}
+static int log_gcmark(void *p, size_t len) {
+    (void) len;
+    struct msgpack_log *log = p;
+    if (log->keys != NULL) janet_mark(janet_wrap_array(log->keys));
+    return 0;
+}
+static int log_get(void *p, Janet key, Janet *out);
+static const JanetAbstractType msgpack_log_type = {
+    "msgpack/log",
+    log_gc,
+    log_gcmark,
+    log_get,
+    JANET_ATEND_GET
+};
+
+/**
+ * Find the end of the previous footer before `end`, or zero if there isn't one.
+ */
+static size_t log_previous_footer(const uint8_t *data, size_t end) {
+    while (--end >= MSGPACK_LOG_FOOTER_LEN) {
+        if (memcmp(data + end - 4, MSGPACK_LOG_MAGIC, 4) == 0) return end;
+    }
+    return 0;
+}
+/**
+ * Find every complete block in the mapped file, panicking if it isn't a valid log.
+ */
+static void log_load_blocks(struct msgpack_log *log) {
+    const uint8_t *data = log->mapping.data;
+    size_t end = log->mapping.len;
+    // Skip back over a partial block to the last footer (records may contain the magic too, hence the parse)
+    struct msgpack_log_block last;
+    while (end > 0 && !parse_log_block(data, end, &last)) end = log_previous_footer(data, end);
+    log->end = end;
+    uint32_t capacity = 0;
+    while (end > 0) {
+        if (log->block_count == capacity) {
+            capacity = capacity < 16 ? 16 : capacity * 2;
+            struct msgpack_log_block *blocks = janet_realloc(log->blocks, capacity * sizeof(struct msgpack_log_block));
+            if (blocks == NULL) janet_panic("out of memory loading msgpack log");
+            log->blocks = blocks;
+        }
+        struct msgpack_log_block *block = &log->blocks[log->block_count];
+        if (!parse_log_block(data, end, block)) {
+            janet_panicf("Corrupt msgpack log block ending at offset %v", janet_wrap_number((double) end));
+        }
+        log->block_count += 1;
+        end = block->start;
+    }
+    // Blocks were found last to first
+    for (uint32_t i = 0; i < log->block_count / 2; i++) {
+        struct msgpack_log_block tmp = log->blocks[i];
+        log->blocks[i] = log->blocks[log->block_count - 1 - i];
+        log->blocks[log->block_count - 1 - i] = tmp;
+    }
+    for (uint32_t i = 0; i < log->block_count; i++) {
+        if (log->blocks[i].first != log->record_count) {
+            janet_panicf("Corrupt msgpack log: block %d does not follow on from the previous block", (int32_t) i);
+        }
+        log->record_count += log->blocks[i].count;
+    }
+}
+
+/**
+ * Decode log keys with immutable types, so they compare by value.
+ */
+static Janet decode_log_keys(const uint8_t *data, size_t len) {
+    mpack_reader_t reader;
+    mpack_reader_init_data(&reader, (const char*) data, len);
+    mpack_reader_set_error_handler(&reader, janet_msgpack_error_handler);
+    struct janet_msgpack_decoder decoder = {
+        .reader = &reader,
+        .message = data,
+        .message_len = len,
+        .string_type = JANET_STRING,
+        .bin_type = JANET_TYPE_IMMUTABLE,
+        .array_type = JANET_TYPE_IMMUTABLE,
+        .map_type = JANET_TYPE_IMMUTABLE
+    };
+    parse_decode_options(&decoder, janet_wrap_nil());
+    return decode_msgpack(&decoder, 0);
+}
+/**
+ * Round-trip a key through msgpack, so it compares like the keys read back from the log.
+ */
+static Janet normalize_log_key(Janet key) {
+    JanetBuffer *buffer = janet_buffer(16);
+    struct msgpack_encoder encoder = {
+        .buffer = buffer,
+        .string_type = MSGPACK_STRING_STRING,
+        .buffer_type = MSGPACK_BYTES_STRING,
+    };
+    encode_msgpack(&encoder, key, 0);
+    return decode_log_keys(buffer->data, (size_t) buffer->count);
+}
+static Janet log_block_keys(struct msgpack_log *log, uint32_t index) {
+    const struct msgpack_log_block *block = &log->blocks[index];
+    if (block->keys == 0) return janet_wrap_nil();
+    Janet cached = log->keys->data[index];
+    if (!janet_checktype(cached, JANET_NIL)) return cached;
+    Janet keys = decode_log_keys(log->mapping.data + block->keys, log->mapping.len - block->keys);
+    log->keys->data[index] = keys;
+    return keys;
+}
+
+/**
+ * Find the block holding record n, which must be in range.
+ */
+static uint32_t log_find_block(const struct msgpack_log *log, uint64_t n) {
+    uint32_t low = 0, high = log->block_count;
+    while (high - low > 1) {
+        uint32_t mid = low + (high - low) / 2;
+        if (log->blocks[mid].first <= n) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
 
+static uint64_t log_getrecord(const struct msgpack_log *log, const Janet *argv, int32_t n) {
+    int64_t index = janet_getinteger64(argv, n);
+    if (index < 0 || (uint64_t) index >= log->record_count) {
+        janet_panicf("Record %v out of range [0, %d)", argv[n], (int32_t) log->record_count);
+    }
+    return (uint64_t) index;
+}
+
+static Janet cfun_log_count(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    struct msgpack_log *log = janet_getabstract(argv, 0, &msgpack_log_type);
+    return janet_wrap_number((double) log->record_count);
+}
+static Janet cfun_log_get(int32_t argc, Janet *argv) {
+    janet_arity(argc, 2, 4);
+    struct msgpack_log *log = janet_getabstract(argv, 0, &msgpack_log_type);
+    uint64_t n = log_getrecord(log, argv, 1);
+    const struct msgpack_log_block *block = &log->blocks[log_find_block(log, n)];
+    uint32_t i = (uint32_t) (n - block->first);
+    size_t start = block->start + (size_t) read_bigendian(block->offsets + 4 * i, 4);
+    size_t end = i + 1 < block->count ? block->start + (size_t) read_bigendian(block->offsets + 4 * (i + 1), 4) : block->index;
+    return decode_msgpack_data(
+        log->mapping.data + start, end - start,
+        argc > 2 ? argv[2] : janet_wrap_nil(),
+        argc > 3 ? argv[3] : janet_wrap_nil()
+    );
+}
+static Janet cfun_log_key(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    struct msgpack_log *log = janet_getabstract(argv, 0, &msgpack_log_type);
+    uint64_t n = log_getrecord(log, argv, 1);
+    uint32_t index = log_find_block(log, n);
+    Janet keys = log_block_keys(log, index);
+    if (janet_checktype(keys, JANET_NIL)) return keys;
+    return janet_unwrap_tuple(keys)[n - log->blocks[index].first];
+}
+static Janet cfun_log_find(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    struct msgpack_log *log = janet_getabstract(argv, 0, &msgpack_log_type);
+    Janet key = normalize_log_key(argv[1]);
+    // Find the last block whose first key is <= key
+    uint32_t low = 0, high = log->block_count;
+    while (high - low > 1) {
+        uint32_t mid = low + (high - low) / 2;
+        Janet keys = log_block_keys(log, mid);
+        if (janet_checktype(keys, JANET_NIL)) janet_panic("msgpack log has no keys");
+        if (janet_compare(janet_unwrap_tuple(keys)[0], key) < 0) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    // Equal keys may straddle blocks, so search onwards from there
+    for (uint32_t b = low; b < log->block_count; b++) {
+        Janet keys = log_block_keys(log, b);
+        if (janet_checktype(keys, JANET_NIL)) janet_panic("msgpack log has no keys");
+        const Janet *tuple = janet_unwrap_tuple(keys);
+        int32_t count = janet_tuple_length(tuple);
+        int32_t lo = 0, hi = count;
+        while (lo < hi) {
+            int32_t mid = lo + (hi - lo) / 2;
+            if (janet_compare(tuple[mid], key) < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo < count) {
+            if (janet_equals(tuple[lo], key)) return janet_wrap_number((double) (log->blocks[b].first + lo));
+            return janet_wrap_nil();
+        }
+    }
+    return janet_wrap_nil();
+}
+static const JanetMethod log_methods[] = {
+    {"count", cfun_log_count},
+    {"get", cfun_log_get},
+    {"key", cfun_log_key},
+    {"find", cfun_log_find},
+    {NULL, NULL}
+};
+static int log_get(void *p, Janet key, Janet *out) {
+    (void) p;
+    if (!janet_checktype(key, JANET_KEYWORD)) return 0;
+    return janet_getmethod(janet_unwrap_keyword(key), log_methods, out);
+}
+
+static Janet janet_msgpack_log_open(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    const char *path = janet_getcstring(argv, 0);
+    struct msgpack_log *log = janet_abstract(&msgpack_log_type, sizeof(struct msgpack_log));
+    log->mapping.data = NULL;
+    log->mapping.len = 0;
+    log->blocks = NULL;
+    log->block_count = 0;
+    log->record_count = 0;
+    log->end = 0;
+    log->keys = NULL;
+    map_file(&log->mapping, path);
+    log_load_blocks(log);
+    log->keys = janet_array((int32_t) log->block_count);
+    for (uint32_t i = 0; i < log->block_count; i++) janet_array_push(log->keys, janet_wrap_nil());
+    return janet_wrap_abstract(log);
+}
+
+struct msgpack_log_writer {
+    FILE *file;
+    // Encoded records of the pending block
+    JanetBuffer *records;
+    // 4-byte offsets of the pending records
+    JanetBuffer *offsets;
+    // Keys of the pending records, or NULL if the log isn't keyed
+    JanetArray *keys;
+    Janet last_key;
+    // Absolute offset the pending block will be written at
+    size_t block_start;
+    uint64_t next_record;
+    uint32_t block_size;
+};
+
+static int log_writer_gc(void *p, size_t len) {
+    (void) len;
+    struct msgpack_log_writer *writer = p;
+    // Unflushed records are lost, just like an unflushed file
+    if (writer->file != NULL) fclose(writer->file);
+    writer->file = NULL;
+    return 0;
+}
+static int log_writer_gcmark(void *p, size_t len) {
+    (void) len;
+    struct msgpack_log_writer *writer = p;
+    if (writer->records != NULL) janet_mark(janet_wrap_buffer(writer->records));
+    if (writer->offsets != NULL) janet_mark(janet_wrap_buffer(writer->offsets));
+    if (writer->keys != NULL) janet_mark(janet_wrap_array(writer->keys));
+    janet_mark(writer->last_key);
+    return 0;
+}
+static int log_writer_get(void *p, Janet key, Janet *out);
+static const JanetAbstractType msgpack_log_writer_type = {
+    "msgpack/log-writer",
+    log_writer_gc,
+    log_writer_gcmark,
+    log_writer_get,
+    JANET_ATEND_GET
+};
+
+static struct msgpack_log_writer *get_open_writer(const Janet *argv, int32_t n) {
+    struct msgpack_log_writer *writer = janet_getabstract(argv, n, &msgpack_log_writer_type);
+    if (writer->file == NULL) janet_panic("msgpack log writer is closed");
+    return writer;
+}
+
+static void log_writer_flush(struct msgpack_log_writer *writer) {
+    uint32_t count = (uint32_t) (writer->offsets->count / 4);
+    if (count == 0) return;
+    JanetBuffer *index = janet_buffer(writer->offsets->count + 32);
+    struct msgpack_encoder encoder = {
+        .buffer = index,
+        .string_type = MSGPACK_STRING_STRING,
+        .buffer_type = MSGPACK_BYTES_STRING,
+    };
+    encode_msgpack_collection_length(&encoder, 4, 0x90, 0xDC);
+    encode_msgpack_int(&encoder, (int64_t) (writer->next_record - count), true);
+    encode_msgpack_int(&encoder, (int64_t) writer->block_start, true);
+    encode_msgpack_string(&encoder, writer->offsets->data, (uint32_t) writer->offsets->count, MSGPACK_BYTES_STRING);
+    if (writer->keys != NULL) {
+        encode_msgpack(&encoder, janet_wrap_array(writer->keys), 0);
+    } else {
+        janet_buffer_push_u8(index, 0xC0);
+    }
+    uint32_t index_len = (uint32_t) index->count;
+    encode_int_without_tag(index, index_len, 4);
+    janet_buffer_push_bytes(index, (const uint8_t*) MSGPACK_LOG_MAGIC, 4);
+    if (fwrite(writer->records->data, 1, writer->records->count, writer->file) != (size_t) writer->records->count ||
+            fwrite(index->data, 1, index->count, writer->file) != (size_t) index->count ||
+            fflush(writer->file) != 0) {
+        janet_panicf("Error writing msgpack log: %s", strerror(errno));
+    }
+    writer->block_start += (size_t) writer->records->count + (size_t) index->count;
+    writer->records->count = 0;
+    writer->offsets->count = 0;
+    if (writer->keys != NULL) writer->keys->count = 0;
+}
+
+static Janet cfun_log_writer_append(int32_t argc, Janet *argv) {
+    janet_arity(argc, 2, 3);
+    struct msgpack_log_writer *writer = get_open_writer(argv, 0);
+    Janet key = argc > 2 ? argv[2] : janet_wrap_nil();
+    if (writer->keys != NULL) {
+        if (janet_checktype(key, JANET_NIL)) janet_panic("Records in a keyed msgpack log must have a key");
+        key = normalize_log_key(key);
+        if (!janet_checktype(writer->last_key, JANET_NIL) && janet_compare(key, writer->last_key) < 0) {
+            janet_panicf("Key %v is less than the previous key %v", key, writer->last_key);
+        }
+    } else if (!janet_checktype(key, JANET_NIL)) {
+        janet_panic("Records in an unkeyed msgpack log can't have a key");
+    }
+    if (writer->records->count > INT32_MAX / 2) {
+        // Keep well clear of the maximum buffer size
+        log_writer_flush(writer);
+    }
+    int32_t offset = writer->records->count;
+    struct msgpack_encoder encoder = {
+        .buffer = writer->records,
+        .string_type = MSGPACK_STRING_STRING,
+        .buffer_type = MSGPACK_BYTES_STRING,
+    };
+    JanetTryState state;
+    if (janet_try(&state)) {
+        // Don't leave half a record behind, to be written as part of the previous one
+        janet_restore(&state);
+        writer->records->count = offset;
+        janet_panicv(state.payload);
+    }
+    encode_msgpack(&encoder, argv[1], 0);
+    janet_restore(&state);
+    encode_int_without_tag(writer->offsets, (uint32_t) offset, 4);
+    if (writer->keys != NULL) {
+        janet_array_push(writer->keys, key);
+        writer->last_key = key;
+    }
+    uint64_t record = writer->next_record++;
+    if ((uint32_t) (writer->offsets->count / 4) >= writer->block_size) {
+        log_writer_flush(writer);
+    }
+    return janet_wrap_number((double) record);
+}
+static Janet cfun_log_writer_flush(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    log_writer_flush(get_open_writer(argv, 0));
+    return argv[0];
+}
+static Janet cfun_log_writer_close(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    struct msgpack_log_writer *writer = janet_getabstract(argv, 0, &msgpack_log_writer_type);
+    if (writer->file == NULL) return janet_wrap_nil();
+    log_writer_flush(writer);
+    log_writer_gc(writer, sizeof(struct msgpack_log_writer));
+    return janet_wrap_nil();
+}
+static Janet cfun_log_writer_count(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    struct msgpack_log_writer *writer = janet_getabstract(argv, 0, &msgpack_log_writer_type);
+    return janet_wrap_number((double) writer->next_record);
+}
+static const JanetMethod log_writer_methods[] = {
+    {"append", cfun_log_writer_append},
+    {"flush", cfun_log_writer_flush},
+    {"close", cfun_log_writer_close},
+    {"count", cfun_log_writer_count},
+    {NULL, NULL}
+};
+static int log_writer_get(void *p, Janet key, Janet *out) {
+    (void) p;
+    if (!janet_checktype(key, JANET_KEYWORD)) return 0;
+    return janet_getmethod(janet_unwrap_keyword(key), log_writer_methods, out);
+}
+
+/**
+ * Cut off the partial block left behind by an interrupted write.
+ */
+static void truncate_file(const char *path, size_t len) {
+    #ifdef _WIN32
+        HANDLE file = CreateFileA(path, GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) janet_panicf("Unable to open %s", path);
+        LARGE_INTEGER size;
+        size.QuadPart = (LONGLONG) len;
+        bool truncated = SetFilePointerEx(file, size, NULL, FILE_BEGIN) && SetEndOfFile(file);
+        CloseHandle(file);
+        if (!truncated) janet_panicf("Unable to truncate %s", path);
+    #else
+        if (truncate(path, (off_t) len) != 0) janet_panicf("Unable to truncate %s: %s", path, strerror(errno));
+    #endif
+}
+
+static Janet janet_msgpack_log_writer(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 2);
+    const char *path = janet_getcstring(argv, 0);
+    Janet options = argc > 1 ? argv[1] : janet_wrap_nil();
+    int64_t block_size = get_limit_option(options, "block-size", 1024);
+    if (block_size < 1 || block_size > UINT32_MAX / 4) janet_panicf("Invalid :block-size %d", (int32_t) block_size);
+    bool keyed = janet_truthy(get_option(options, "keyed"));
+    struct msgpack_log_writer *writer = janet_abstract(&msgpack_log_writer_type, sizeof(struct msgpack_log_writer));
+    writer->file = NULL;
+    writer->records = janet_buffer(1024);
+    writer->offsets = janet_buffer(4 * (int32_t) (block_size < 1024 ? block_size : 1024));
+    writer->keys = NULL;
+    writer->last_key = janet_wrap_nil();
+    writer->block_start = 0;
+    writer->next_record = 0;
+    writer->block_size = (uint32_t) block_size;
+    // Continue on from any existing log
+    FILE *existing = fopen(path, "rb");
+    if (existing != NULL) {
+        fclose(existing);
+        struct msgpack_log *log = janet_unwrap_abstract(janet_msgpack_log_open(1, argv));
+        writer->block_start = log->end;
+        writer->next_record = log->record_count;
+        if (log->block_count > 0) {
+            bool log_keyed = log->blocks[log->block_count - 1].keys != 0;
+            if (log_keyed != keyed) {
+                janet_panicf("Existing msgpack log %s keyed", log_keyed ? "is" : "is not");
+            }
+            if (keyed) {
+                const Janet *keys = janet_unwrap_tuple(log_block_keys(log, log->block_count - 1));
+                writer->last_key = keys[janet_tuple_length(keys) - 1];
+            }
+        }
+        bool partial = log->end < log->mapping.len;
+        log_gc(log, sizeof(struct msgpack_log));
+        if (partial) truncate_file(path, writer->block_start);
+    }
+    if (keyed) writer->keys = janet_array(0);
+    writer->file = fopen(path, "ab");
+    if (writer->file == NULL) janet_panicf("Unable to open %s: %s", path, strerror(errno));
+    return janet_wrap_abstract(writer);
 }
+
 /****************/
 /* Module Entry */
 /****************/
 
 static const JanetReg cfuns[] = {
     {"encode", janet_msgpack_encode,
-        "(msgpack/encode x &opt encoded-string-type buf)\n\n"
+        "(msgpack/encode x &opt encoded-string-type buf options)\n\n"
         "Encodes a janet value into msgpack: https://msgpack.org/\n"
         "\n"
         "The string-type specifies the msgpack type to use for Janet strings/buffers.\n"
@@ -713,15 +6277,334 @@ static const JanetReg cfuns[] = {
         "For example, {:buffer 'bytes :string 'string}\n"
         "\n"
         "If buf is provided, the formated mspack is append to buf instead of a new buffer.\n"
-        "Returns the modifed buffer."
+        "Returns the modifed buffer.\n"
+        "\n"
+        "The options may include an :ext registry of handlers for abstract types,\n"
+        "and a :dictionary of common strings to encode as references (see msgpack/dictionary).\n"
+        "With :dedupe, strings that were already written are replaced by a back-reference ext\n"
+        "(type 102, or :dedupe-ext) to the offset of their first occurrence, whenever that is\n"
+        "shorter. The offsets are relative to the start of the message, so it has to be decoded\n"
+        "on its own (not spliced into another message, or edited in place).\n"
+        "With :shared, each table & array is written once, and later occurrences (including\n"
+        "cycles) become a reference ext (type 103, or :shared-ext) to its offset. Tuples & structs\n"
+        "are compared by value, so equal ones are also written once. The same caveats apply.\n"
+        "With :canonical, map keys are sorted by their encoded bytes and numbers use their\n"
+        "shortest exact encoding (integral doubles as ints, floats when lossless), so equal\n"
+        "values always encode to identical bytes.\n"
+        "With :columnar, arrays of two or more tables/structs sharing the same keys are written\n"
+        "column by column: an ext (type 100, or :columnar-ext) holding [keys column1 column2 ...].\n"
+        "The keys appear once instead of once per record, but only decoders given the\n"
+        ":columnar option can read the result.\n"
+        "\n"
+        "Fibers (such as generators from coro) are encoded as arrays of the values they yield.\n"
+        "Each value is encoded as soon as it is yielded, so the sequence never exists all at once."
+    },
+    {"begin-array", janet_msgpack_begin_array,
+        "(msgpack/begin-array &opt encoded-string-type buf options)\n\n"
+        "Starts encoding an array whose length isn't known yet, returning a builder.\n"
+        "The arguments are the same as msgpack/encode.\n"
+        "\n"
+        "* (:push builder value) - Encode the next element (a key and value for maps)\n"
+        "* (:begin-array builder &opt key) - Start a nested array, returning its builder\n"
+        "* (:begin-map builder &opt key) - Start a nested map, returning its builder\n"
+        "* (:count builder) - Number of elements pushed so far\n"
+        "* (:end builder) - Write the final length into the header, returning the buffer\n"
+        "\n"
+        "Nested builders must be ended before their parent accepts more elements.\n"
+        "Nothing else should write to the buffer until the outermost builder has ended.\n"
+        "With :canonical, the entries of maps are sorted when they end, so :canonical\n"
+        "can't be combined with :dedupe, :shared or :dictionary here."
+    },
+    {"begin-map", janet_msgpack_begin_map,
+        "(msgpack/begin-map &opt encoded-string-type buf options)\n\n"
+        "Starts encoding a map whose length isn't known yet, returning a builder.\n"
+        "Entries are added with (:push builder key value). See msgpack/begin-array."
     },
     {"decode", janet_msgpack_decode,
-        "(msgapck/decode bytes &opt decoded-types)\n\n"
-        "Returns a janet object after parsing msgapck: https://msgpack.org."
+        "(msgapck/decode bytes &opt decoded-types options)\n\n"
+        "Returns a janet object after parsing msgapck: https://msgpack.org.\n"
+        "\n"
+        "The decoded-types map msgpack types to Janet types, for example {:map 'struct :array 'tuple}\n"
+        "\n"
+        "The options limit the resources a single (possibly hostile) message may use:\n"
+        "* :max-elements - Total number of array items and map entries\n"
+        "* :max-bytes - Estimated bytes allocated for the decoded values\n"
+        "* :max-string - Length of any single string or bytes\n"
+        "* :max-depth - Nesting depth of arrays & maps\n"
+        "* :stats - A table that receives the :elements, :bytes and :depth actually used\n"
+        "\n"
+        "Map values whose keys are listed in :raw are not decoded, and are returned as msgpack/raw\n"
+        "values instead, which msgpack/encode will copy back out unchanged. A plain key matches\n"
+        "maps at any depth, while a path such as [:meta :payload] matches only there, like :only.\n"
+        "If :only is given, maps keep just the listed keys, and all other values are skipped\n"
+        "without being decoded. Entries may be paths such as [:meta :host] to select\n"
+        "keys of nested maps, and arrays apply the projection to each of their elements.\n"
+        "Ext types are decoded by the handlers in the :ext registry (see msgpack/register-ext),\n"
+        "and references to a msgpack/dictionary are resolved with the same :dictionary.\n"
+        "Messages encoded with :dedupe must be decoded with {:dedupe true}, which resolves\n"
+        "each repeated string to one shared Janet string. Likewise {:shared true} rebuilds\n"
+        "containers shared with :shared as the same Janet value, including cycles as long as\n"
+        "they pass through a mutable table or array. :shared can't be combined with :only.\n"
+        "Timestamps decode to (fractional) seconds since the epoch by default,\n"
+        "or to msgpack/timestamp values with {:timestamp 'abstract}.\n"
+        "Arrays written with the :columnar encode option are rebuilt into records with\n"
+        "{:columnar true}, or left as a map of key -> array of values with {:columnar 'columns}.\n"
+        "\n"
+        "Container lengths are always checked against the remaining input before anything is allocated."
+    },
+    {"scan", janet_msgpack_scan,
+        "(msgpack/scan bytes &opt options)\n\n"
+        "Validates the msgpack object starting at the :start offset without decoding it.\n"
+        "\n"
+        "Returns a struct with the :end offset of the object, the number of :elements\n"
+        "(array items & map entries) and the maximum nesting :depth.\n"
+        "Panics if the object is malformed.\n"
+        "\n"
+        "If :utf8 is truthy strings must be valid UTF-8, and if :single is truthy\n"
+        "the object must extend to the end of the input. A :max-depth may also be given."
+    },
+    {"valid?", janet_msgpack_valid,
+        "(msgpack/valid? bytes &opt options)\n\n"
+        "Checks whether bytes holds well-formed msgpack, without decoding it.\n"
+        "\n"
+        "By default the bytes must contain exactly one object. Passing {:single false}\n"
+        "accepts any sequence of concatenated objects instead.\n"
+        "The :utf8 and :max-depth options are the same as msgpack/scan."
+    },
+    {"tape", janet_msgpack_tape,
+        "(msgpack/tape bytes &opt options)\n\n"
+        "Builds a structural index (\"tape\") over the msgpack object at the :start offset.\n"
+        "\n"
+        "Every object gets one entry on the tape, in the order it appears in the input.\n"
+        "Entries are navigated by index using methods on the tape:\n"
+        "* (:length tape) - Number of entries\n"
+        "* (:type tape i) - The msgpack type, such as :map or :str\n"
+        "* (:count tape i) - Element count of an array/map, or byte length of a str/bin/ext\n"
+        "* (:next tape i) - The index just past the subtree at i, skipping it in O(1)\n"
+        "* (:extent tape i) - The [start end] byte offsets of the subtree at i\n"
+        "* (:child tape i n) - The index of the nth child (maps alternate keys & values)\n"
+        "* (:lookup tape i key) - The index of the value for a string key in the map at i\n"
+        "* (:decode tape &opt i decoded-types) - Materialise the Janet value at i\n"
+        "\n"
+        "Strings are checked as UTF-8 while building, unless :utf8 is false."
+    },
+    {"assoc", janet_msgpack_assoc,
+        "(msgpack/assoc bytes key value)\n\n"
+        "Returns a new buffer with the encoded map or array in bytes changed so that key\n"
+        "is associated with value, without decoding the rest of the message.\n"
+        "\n"
+        "Missing map keys are added, and an array index equal to the length appends.\n"
+        "Associating nil with a map key removes it, as with tables."
+    },
+    {"dissoc", janet_msgpack_dissoc,
+        "(msgpack/dissoc bytes key)\n\n"
+        "Returns a new buffer with key removed from the encoded map or array in bytes.\n"
+        "Missing keys are ignored."
+    },
+    {"update-in", janet_msgpack_update_in,
+        "(msgpack/update-in bytes path f & args)\n\n"
+        "Like update-in, but for encoded msgpack. Only the value at path is decoded,\n"
+        "and the result of (f old-value ;args) is encoded in its place.\n"
+        "\n"
+        "Every container along the path must already exist, though the final key\n"
+        "may be missing. Returns a new buffer."
+    },
+    {"select", janet_msgpack_select,
+        "(msgpack/select bytes &opt query)\n\n"
+        "Filters and aggregates a stream of concatenated msgpack records (such as a file\n"
+        "from msgpack/open-file) without decoding the records that don't match.\n"
+        "\n"
+        "Fields are a key, or a path of keys such as [:user :id]. The query may include:\n"
+        "* :where - Clauses that must all hold, like [:= field value], [:> field n] or [:has field].\n"
+        "  The operators are :=, :not=, :<, :<=, :>, :>= and :has. Numbers compare with numbers,\n"
+        "  strings with strings, and values of different types are never equal.\n"
+        "* :count, :sum, :min, :max - Aggregate instead of returning records. :count is a flag,\n"
+        "  the others name a numeric field. Returns a struct such as {:count 3 :sum 12}.\n"
+        "* :group-by - A string field to aggregate by, returning a table of structs.\n"
+        "  Records without that string are grouped under :nil.\n"
+        "* :limit - Stop after this many matching records.\n"
+        "* :decoded-types - Passed on to msgpack/decode for matching records.\n"
+        "\n"
+        "Without aggregates, returns an array of the decoded matching records."
+    },
+    {"hash", janet_msgpack_hash,
+        "(msgpack/hash bytes)\n\n"
+        "Returns a 64-bit hash (an int/u64) of the encoded value, without decoding it.\n"
+        "\n"
+        "Values that msgpack/equal? considers equal always hash the same, however they were\n"
+        "encoded: numbers hash by value, map entries in any order, and timestamps by time.\n"
+        "This is not a cryptographic hash. The bytes must hold exactly one object."
+    },
+    {"equal?", janet_msgpack_equal,
+        "(msgpack/equal? a b)\n\n"
+        "Checks whether two encoded values are equal, without decoding them.\n"
+        "\n"
+        "Numbers compare by value regardless of width or format (so 1, 1.0 and a 64-bit 1 are equal),\n"
+        "maps ignore the order of their entries, and timestamps compare by the time they hold.\n"
+        "Strings and bytes are never equal to each other, and NaN is equal to itself.\n"
+        "Trailing bytes after an otherwise equal object are an error."
+    },
+    {"to-json", janet_msgpack_to_json,
+        "(msgpack/to-json bytes &opt buf)\n\n"
+        "Converts a msgpack object straight to JSON text, without building Janet values.\n"
+        "If buf is provided the JSON is appended to it. Returns the buffer.\n"
+        "\n"
+        "Integer map keys are quoted, bin is written as a base64 string,\n"
+        "timestamps as fractional seconds and non-finite floats as null.\n"
+        "The bytes must hold exactly one object."
+    },
+    {"from-json", janet_msgpack_from_json,
+        "(msgpack/from-json text &opt buf)\n\n"
+        "Converts JSON text straight to msgpack, without building Janet values.\n"
+        "If buf is provided the msgpack is appended to it. Returns the buffer.\n"
+        "\n"
+        "Integers are encoded as the smallest msgpack int that holds them,\n"
+        "and all other numbers as doubles."
+    },
+    {"compile-schema", janet_msgpack_compile_schema,
+        "(msgpack/compile-schema description)\n\n"
+        "Compiles a description of a fixed message shape into a faster encoder.\n"
+        "\n"
+        "A description is one of the types :int, :float, :str, :bin, :bool or :any,\n"
+        "an [element-type] array, or a {key type ...} record, for example\n"
+        "{:id :int :name :str :tags [:str]}.\n"
+        "\n"
+        "(:encode schema x &opt buf) encodes x by its declared types, panicking if it\n"
+        "doesn't match. Record keys are encoded in sorted order, and any keys missing\n"
+        "from the schema are left out. Only :any fields may be missing (encoded as nil).\n"
+        ":float fields use the fewest bytes that round-trip the value (an int, float or double).\n"
+        "\n"
+        "(:decode schema bytes) decodes by the declared types, panicking if the message\n"
+        "doesn't match. Records become structs, and keys missing from the schema are skipped."
+    },
+    {"decode-parallel", janet_msgpack_decode_parallel,
+        "(msgpack/decode-parallel bytes &opt decoded-types options)\n\n"
+        "Decodes a large top-level array or map using several native threads.\n"
+        "\n"
+        "A structural pre-scan splits the top-level elements into byte ranges, and each\n"
+        "thread validates its range and builds a tape for it. The Janet value is then\n"
+        "assembled on the calling thread, with the same result as msgpack/decode.\n"
+        "Any other top-level value is simply decoded with msgpack/decode.\n"
+        "\n"
+        "The options are the same as msgpack/decode, plus the number of :threads\n"
+        "(defaulting to the number of CPUs)."
+    },
+    {"encode-parallel", janet_msgpack_encode_parallel,
+        "(msgpack/encode-parallel x &opt encoded-string-type buf options)\n\n"
+        "Encodes a large array/tuple/table/struct using several native threads.\n"
+        "\n"
+        "The elements are split into one chunk per thread, each encoded into its own\n"
+        "buffer and then appended after the container header, with the same result as\n"
+        "msgpack/encode. The value is treated as a read-only snapshot, which is safe\n"
+        "because the calling thread blocks until the workers are done.\n"
+        "\n"
+        "The options are the same as msgpack/encode, plus the number of :threads\n"
+        "(defaulting to the number of CPUs). :dedupe and :shared aren't supported,\n"
+        "since they depend on the whole message at once. With :canonical, the entries\n"
+        "of a top-level table/struct are sorted before they're split between the workers.\n"
+        "\n"
+        "Fibers can't be encoded, since they can only be resumed on the calling thread,\n"
+        "and neither can ext types whose encoder is a Janet function (native ones are fine).\n"
+        "If encoding fails, buf is left as it was."
+    },
+    {"open-file", janet_msgpack_open_file,
+        "(msgpack/open-file path)\n\n"
+        "Maps the file at path into memory (read-only), returning a file mapping.\n"
+        "\n"
+        "A mapping can be passed anywhere msgpack bytes are expected (decode, scan, tape, ...)\n"
+        "without copying the file into a string first. Pages are read from the file as they\n"
+        "are touched, and the file is unmapped once the mapping (and any tape over it)\n"
+        "is garbage collected."
+    },
+    {"decode-file", janet_msgpack_decode_file,
+        "(msgpack/decode-file path &opt decoded-types options)\n\n"
+        "Decodes the msgpack stored in a file, reading it through a temporary memory\n"
+        "mapping instead of a string. Arguments are otherwise the same as msgpack/decode."
+    },
+    {"log-writer", janet_msgpack_log_writer,
+        "(msgpack/log-writer path &opt options)\n\n"
+        "Opens an append-only log of msgpack records, continuing on from any existing log at path.\n"
+        "A partial block left at the end of the file by an interrupted write is truncated.\n"
+        "\n"
+        "Records are written in blocks of :block-size records (default 1024), each followed\n"
+        "by an index so msgpack/log-open can find any record without scanning the file.\n"
+        "If :keyed is truthy, every record must have a key that is >= the previous key.\n"
+        "Keys are compared as they read back from msgpack, so keywords and strings are equivalent.\n"
+        "\n"
+        "Methods:\n"
+        "* (:append writer value &opt key) - Append a record, returning its number\n"
+        "* (:flush writer) - Write out the pending block, even if it isn't full\n"
+        "* (:close writer) - Flush and close the file. Unflushed records are lost if this isn't called\n"
+        "* (:count writer) - Total number of records written"
+    },
+    {"log-open", janet_msgpack_log_open,
+        "(msgpack/log-open path)\n\n"
+        "Opens a log written by msgpack/log-writer for random access, through a memory mapping.\n"
+        "A partial block left at the end of the file by an interrupted write is ignored.\n"
+        "\n"
+        "Methods:\n"
+        "* (:count log) - Number of records\n"
+        "* (:get log n &opt decoded-types options) - Decode record n\n"
+        "* (:key log n) - The key of record n\n"
+        "* (:find log key) - The number of the first record with the key, using binary search"
+    },
+    {"ext-registry", janet_msgpack_ext_registry,
+        "(msgpack/ext-registry)\n\n"
+        "Creates an empty registry of ext type handlers, for use with msgpack/register-ext.\n"
+        "Pass it to msgpack/encode and msgpack/decode as the :ext option."
+    },
+    {"register-ext", janet_msgpack_register_ext,
+        "(msgpack/register-ext registry ext-type decoder &opt abstract-type encoder)\n\n"
+        "Registers handlers for an ext type, returning the registry.\n"
+        "\n"
+        "The decoder is called with the payload (a string) and returns the decoded value.\n"
+        "C functions are called directly, without going through the Janet VM.\n"
+        "\n"
+        "If an abstract type name is given, abstract values of that type are encoded\n"
+        "as this ext type, with the encoder returning the payload bytes.\n"
+        "Registered handlers take priority over the built-in timestamp support."
+    },
+    {"raw", janet_msgpack_raw,
+        "(msgpack/raw bytes &opt validate)\n\n"
+        "Wraps a single already-encoded msgpack object, which msgpack/encode copies into\n"
+        "its output verbatim. The bytes are checked to be well-formed unless validate is false.\n"
+        "\n"
+        "Raw values are also produced by decoding with the :raw option, and may be passed\n"
+        "to msgpack/decode. (get raw :bytes) returns the encoded bytes."
+    },
+    {"dictionary", janet_msgpack_dictionary,
+        "(msgpack/dictionary entries &opt ext-type)\n\n"
+        "Creates a dictionary of common map keys and string values, shared by an encoder\n"
+        "and decoder through their :dictionary options. Encoded entries are replaced by a\n"
+        "1 or 2 byte reference ext (type 101 by default), which decodes directly to a\n"
+        "pre-built keyword or string. Entries are only referenced when that is shorter.\n"
+        "\n"
+        "The entries are an array of strings, keywords or symbols (at most 65536), or the\n"
+        "encoded bytes of one, so a dictionary can be saved & loaded with\n"
+        "(spit path (msgpack/encode (get dictionary :entries))) and (msgpack/dictionary (slurp path)).\n"
+        "Both ends must use the same entries in the same order."
+    },
+    {"timestamp", janet_msgpack_timestamp,
+        "(msgpack/timestamp seconds &opt nanoseconds)\n\n"
+        "Creates a timestamp, which msgpack/encode writes as the standard timestamp extension\n"
+        "(type -1) using the smallest of the 32, 64 and 96-bit forms.\n"
+        "\n"
+        "Without nanoseconds, fractional seconds are rounded to the nearest nanosecond.\n"
+        "The :seconds and :nanoseconds of a timestamp can be read with get."
     },
     {NULL, NULL, NULL}
 };
 
 JANET_MODULE_ENTRY(JanetTable *env) {
+    janet_register_abstract_type(&msgpack_timestamp_type);
+    janet_register_abstract_type(&msgpack_raw_type);
+    janet_register_abstract_type(&msgpack_dictionary_type);
+    janet_register_abstract_type(&msgpack_builder_type);
+    janet_register_abstract_type(&msgpack_schema_type);
+    janet_register_abstract_type(&msgpack_ext_registry_type);
+    janet_register_abstract_type(&msgpack_tape_type);
+    janet_register_abstract_type(&msgpack_mapping_type);
+    janet_register_abstract_type(&msgpack_log_type);
+    janet_register_abstract_type(&msgpack_log_writer_type);
     janet_cfuns(env, "msgpack", cfuns);
 }